@@ -1,85 +1,440 @@
 // SPDX-License-Identifier: MIT
 // Copyright (c) 2025 Zhijian Yan
 
+#if defined(__linux__) && !defined(_POSIX_C_SOURCE)
+/* clock_gettime() is hidden in strict ISO C modes otherwise */
+#define _POSIX_C_SOURCE 200809L
+#endif
+
 #include "softimer.h"
 #include <stddef.h>
 #include <string.h>
+#if defined(STIM_DISPATCH_WAIT)
+#include <poll.h>
+#endif
+#if defined(STIM_DISPATCH_WAIT) || defined(STIM_POLL_WAIT)
+#include <sys/eventfd.h>
+#include <unistd.h>
+#endif
+#if defined(STIM_POLL_WAIT)
+#include <errno.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#endif
+#if defined(STIM_POLL_WAIT) && defined(STIM_LOCKFREE_QUEUE)
+#include <sched.h>
+/* poll_fd while the context that won the CAS creates the descriptors */
+#define STIM_FD_PENDING (-2)
+#endif
+#if defined(STIM_POLL_WAIT) ||                                                 \
+    (defined(STIM_MONOTONIC_TICKS) && !defined(STIM_TICK_CLOCK))
+#include <time.h>
+#define STIM_HAVE_CLOCK_NS
+#endif
 
 #define STIM_TICK_OUT_OF_RANGE(tick) (tick > STIM_MAX_TICKS || tick == 0)
 #define container_of(ptr, type, member)                                        \
     ((type *)((char *)(ptr) - offsetof(type, member)))
 
-typedef enum {
-    STIM_COMMAND_STOP = 0,
-    STIM_COMMAND_START,
-} stim_command_t;
+#if defined(STIM_STATS)
+#define STIM_STATS_ADD(sched, field, value) ((sched)->stats.field += (value))
+#define STIM_STATS_MAX(sched, field, value)                                    \
+    do {                                                                       \
+        if ((value) > (sched)->stats.field) {                                  \
+            (sched)->stats.field = (value);                                    \
+        }                                                                      \
+    } while (0)
+#else
+#define STIM_STATS_ADD(sched, field, value) ((void)0)
+#define STIM_STATS_MAX(sched, field, value) ((void)0)
+#endif
+
+#if defined(STIM_HISTOGRAM) && defined(STIM_HISTOGRAM_CLOCK)
+#define STIM_CLOCK(sched) ((uint32_t)STIM_HISTOGRAM_CLOCK())
+#elif defined(STIM_HISTOGRAM)
+#define STIM_CLOCK(sched) ((uint32_t)stim_get_ticks(sched))
+#endif
 
-typedef struct {
-    stim_t *timer;
-    stim_command_t command;
-} stim_message_t;
-
-typedef struct {
-    stim_message_t buffer[STIM_QUEUE_SIZE];
-    volatile uint8_t write_index;
-    volatile uint8_t read_index;
-} stim_queue_t;
-
-static stim_node_t list = {
-    .next = &list,
-    .prev = &list,
+#if defined(STIM_SCHED_WHEEL)
+#define STIM_WHEEL_ROOT_MASK (STIM_WHEEL_ROOT_SIZE - 1)
+#define STIM_WHEEL_LEVEL_MASK (STIM_WHEEL_LEVEL_SIZE - 1)
+#endif
+
+static stim_sched_t stim_default_sched = {
+#if !defined(STIM_SCHED_WHEEL) && !defined(STIM_SCHED_HEAP)
+    .list =
+        {
+            .next = &stim_default_sched.list,
+            .prev = &stim_default_sched.list,
+        },
+#endif
+    .ticks = 0,
+#if defined(STIM_DISPATCH_WAIT)
+    .event_fd = -1,
+#endif
+#if defined(STIM_POLL_WAIT)
+    .poll_fd = -1,
+    .command_fd = -1,
+    .timer_fd = -1,
+#endif
 };
 
-static volatile uint32_t stim_ticks = 0;
-static stim_queue_t stim_command_queue;
-static stim_queue_t stim_expired_queue;
+void stim_sched_tick_inc(stim_sched_t *sched) {
+#ifdef STIM_ATOMIC_TICKS
+    ++sched->ticks;
+#else
+    int stim_lock_state;
+    stim_lock_state = stim_lock();
+    ++sched->ticks;
+    stim_unlock(stim_lock_state);
+#endif
+}
 
 void stim_tick_inc(void) {
+    stim_sched_tick_inc(&stim_default_sched);
+}
+
+void stim_sched_tick_advance(stim_sched_t *sched, stim_tick_t ticks) {
 #ifdef STIM_ATOMIC_TICKS
-    ++stim_ticks;
+    sched->ticks += ticks;
 #else
     int stim_lock_state;
     stim_lock_state = stim_lock();
-    ++stim_ticks;
+    sched->ticks += ticks;
     stim_unlock(stim_lock_state);
 #endif
 }
 
-static uint32_t stim_get_ticks(void) {
-#ifdef STIM_ATOMIC_TICKS
-    return stim_ticks;
+void stim_tick_advance(stim_tick_t ticks) {
+    stim_sched_tick_advance(&stim_default_sched, ticks);
+}
+
+#if defined(STIM_HAVE_CLOCK_NS)
+static uint64_t stim_clock_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+#endif
+
+#if defined(STIM_MONOTONIC_TICKS) && !defined(STIM_TICK_CLOCK)
+#define STIM_TICK_CLOCK() (stim_clock_ns() / STIM_TICK_NS)
+#endif
+
+/*
+ * With STIM_MONOTONIC_TICKS the ticks are read from STIM_TICK_CLOCK(), and
+ * sched->ticks only holds the offset added by stim_tick_inc/advance.
+ */
+static stim_tick_t stim_get_ticks(stim_sched_t *sched) {
+    stim_tick_t ticks;
+#if defined(STIM_ATOMIC_TICKS) && defined(STIM_TICKS_64) &&                    \
+    (UINTPTR_MAX < UINT64_MAX)
+    /* A 64-bit load is two accesses here, retry until it was not torn */
+    do {
+        ticks = sched->ticks;
+    } while (ticks != sched->ticks);
+#elif defined(STIM_ATOMIC_TICKS)
+    ticks = sched->ticks;
 #else
-    uint32_t ticks;
     int stim_lock_state;
     stim_lock_state = stim_lock();
-    ticks = stim_ticks;
+    ticks = sched->ticks;
     stim_unlock(stim_lock_state);
+#endif
+#if defined(STIM_MONOTONIC_TICKS)
+    ticks += (stim_tick_t)STIM_TICK_CLOCK();
+#endif
     return ticks;
+}
+
+#if defined(STIM_POLL_WAIT)
+/*
+ * The epoll descriptor watches a timerfd armed for the next expiry and an
+ * eventfd signalled by every queued command. Returns the epoll descriptor,
+ * the other two are stored before the caller publishes it.
+ */
+static int stim_poll_create(stim_sched_t *sched) {
+    int i;
+    int fds[3];
+    struct epoll_event event;
+    fds[0] = epoll_create1(EPOLL_CLOEXEC);
+    fds[1] = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    fds[2] = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    event.events = EPOLLIN;
+    event.data.u64 = 0;
+    if (fds[0] >= 0 && fds[1] >= 0 && fds[2] >= 0 &&
+        !epoll_ctl(fds[0], EPOLL_CTL_ADD, fds[1], &event) &&
+        !epoll_ctl(fds[0], EPOLL_CTL_ADD, fds[2], &event)) {
+        sched->timer_fd = fds[1];
+        sched->command_fd = fds[2];
+    } else {
+        for (i = 0; i < 3; ++i) {
+            if (fds[i] >= 0) {
+                close(fds[i]);
+            }
+        }
+        fds[0] = -1;
+    }
+    return fds[0];
+}
+
+/* Created on first use, by the poll loop or by the first producer */
+static int stim_poll_setup(stim_sched_t *sched) {
+#if defined(STIM_LOCKFREE_QUEUE)
+    /*
+     * stim_lock() may be a stub here, so a CAS elects a single creator and
+     * concurrent callers wait until its descriptors are published.
+     */
+    int fd = -1;
+    if (atomic_compare_exchange_strong(&sched->poll_fd, &fd,
+                                       STIM_FD_PENDING)) {
+        fd = stim_poll_create(sched);
+        atomic_store(&sched->poll_fd, fd);
+    }
+    while (fd == STIM_FD_PENDING) {
+        sched_yield();
+        fd = atomic_load(&sched->poll_fd);
+    }
+#else
+    int stim_lock_state;
+    int fd = sched->poll_fd;
+    if (fd < 0) {
+        stim_lock_state = stim_lock();
+        if (sched->poll_fd < 0) {
+            sched->poll_fd = stim_poll_create(sched);
+        }
+        fd = sched->poll_fd;
+        stim_unlock(stim_lock_state);
+    }
+#endif
+    return fd;
+}
+
+static void stim_poll_notify(stim_sched_t *sched) {
+    uint64_t value = 1;
+    ssize_t n;
+    if (stim_poll_setup(sched) >= 0) {
+        n = write(sched->command_fd, &value, sizeof(value));
+        (void)n;
+    }
+}
+
+/*
+ * Advance the ticks by the whole ticks elapsed on CLOCK_MONOTONIC, clock_ns
+ * tracks the start of the current tick.
+ */
+static void stim_clock_sync(stim_sched_t *sched) {
+    uint64_t now = stim_clock_ns();
+#if defined(STIM_MONOTONIC_TICKS)
+    /* The ticks follow the clock by themselves */
+    sched->clock_ns = now - now % STIM_TICK_NS;
+#else
+    uint64_t elapsed;
+    if (!sched->clock_ns) {
+        sched->clock_ns = now;
+    }
+    elapsed = (now - sched->clock_ns) / STIM_TICK_NS;
+    if (elapsed) {
+        stim_sched_tick_advance(sched, (stim_tick_t)elapsed);
+        sched->clock_ns += elapsed * STIM_TICK_NS;
+    }
+#endif
+}
+#endif
+
+#if defined(STIM_HISTOGRAM)
+static void stim_histogram_add(uint32_t *buckets, stim_tick_t value) {
+    uint32_t i = 0;
+    while (value && i < STIM_HISTOGRAM_BUCKETS - 1) {
+        value >>= 1;
+        ++i;
+    }
+    ++buckets[i];
+}
 #endif
+
+#if defined(STIM_LOCKFREE_QUEUE)
+/*
+ * Bounded MPSC ring: producers reserve a slot by advancing write_index with
+ * CAS, then publish it through the slot sequence. A slot at position pos is
+ * free when its sequence equals the lap (pos with the index bits cleared),
+ * holds a message when it equals lap + 1, and is handed back to producers of
+ * the next lap by the consumer. Zero-initialized queues are valid.
+ */
+static int stim_queue_reserve(stim_queue_t *queue, unsigned int num,
+                              unsigned int *index) {
+    int ret = 0;
+    int diff;
+    unsigned int w;
+    unsigned int last;
+    stim_slot_t *slot;
+    if (num > STIM_QUEUE_CAPACITY) {
+        ret = -STIM_EINVAL;
+    } else {
+        w = atomic_load_explicit(&queue->write_index, memory_order_relaxed);
+    }
+    while (!ret) {
+        /* The consumer frees slots in order, so checking the last will do */
+        last = w + num - 1;
+        slot = &queue->buffer[last & (STIM_QUEUE_SIZE - 1)];
+        diff = (int)(atomic_load_explicit(&slot->sequence,
+                                          memory_order_acquire) -
+                     (last & ~(unsigned int)(STIM_QUEUE_SIZE - 1)));
+        if (diff == 0) {
+            if (atomic_compare_exchange_weak_explicit(
+                    &queue->write_index, &w, w + num, memory_order_relaxed,
+                    memory_order_relaxed)) {
+                *index = w;
+                break;
+            }
+        } else if (diff < 0) {
+            ret = -STIM_EAGAIN;
+        } else {
+            w = atomic_load_explicit(&queue->write_index,
+                                     memory_order_relaxed);
+        }
+    }
+    return ret;
+}
+
+static void stim_queue_fill(stim_queue_t *queue, unsigned int index,
+                            const stim_message_t *message) {
+    stim_slot_t *slot = &queue->buffer[index & (STIM_QUEUE_SIZE - 1)];
+    slot->message = *message;
+    atomic_store_explicit(&slot->sequence,
+                          (index & ~(unsigned int)(STIM_QUEUE_SIZE - 1)) + 1,
+                          memory_order_release);
 }
 
 static int stim_queue_send(stim_queue_t *queue, const stim_message_t *message) {
-    int stim_lock_state;
+    int ret;
+    unsigned int index;
+    ret = stim_queue_reserve(queue, 1, &index);
+    if (!ret) {
+        stim_queue_fill(queue, index, message);
+    }
+    return ret;
+}
+
+#if defined(STIM_STATS)
+/* Only meaningful in the consumer, which owns read_index */
+static unsigned int stim_queue_depth(stim_queue_t *queue) {
+    return atomic_load_explicit(&queue->write_index, memory_order_relaxed) -
+           queue->read_index;
+}
+#endif
+
+#if defined(STIM_DISPATCH_WORKERS)
+/*
+ * Consumers claim a published slot by advancing read_index with CAS. Slots
+ * may then be freed out of order, which is fine for single-slot sends, the
+ * only kind the expired queue sees.
+ */
+static int stim_queue_receive(stim_queue_t *queue, stim_message_t *message) {
     int ret = 0;
-    uint8_t w;
-    uint8_t next;
-    stim_lock_state = stim_lock();
-    w = queue->write_index;
-    next = (w + 1) & (STIM_QUEUE_SIZE - 1);
-    if (next == queue->read_index) {
+    int diff;
+    unsigned int r;
+    unsigned int lap;
+    stim_slot_t *slot;
+    r = atomic_load_explicit(&queue->read_index, memory_order_relaxed);
+    while (!ret) {
+        lap = r & ~(unsigned int)(STIM_QUEUE_SIZE - 1);
+        slot = &queue->buffer[r & (STIM_QUEUE_SIZE - 1)];
+        diff = (int)(atomic_load_explicit(&slot->sequence,
+                                          memory_order_acquire) -
+                     (lap + 1));
+        if (diff == 0) {
+            if (atomic_compare_exchange_weak_explicit(
+                    &queue->read_index, &r, r + 1, memory_order_relaxed,
+                    memory_order_relaxed)) {
+                *message = slot->message;
+                atomic_store_explicit(&slot->sequence, lap + STIM_QUEUE_SIZE,
+                                      memory_order_release);
+                break;
+            }
+        } else if (diff < 0) {
+            ret = -STIM_EAGAIN;
+        } else {
+            r = atomic_load_explicit(&queue->read_index,
+                                     memory_order_relaxed);
+        }
+    }
+    return ret;
+}
+#else
+static int stim_queue_receive(stim_queue_t *queue, stim_message_t *message) {
+    int ret = 0;
+    unsigned int r = queue->read_index;
+    unsigned int lap = r & ~(unsigned int)(STIM_QUEUE_SIZE - 1);
+    stim_slot_t *slot = &queue->buffer[r & (STIM_QUEUE_SIZE - 1)];
+    if (atomic_load_explicit(&slot->sequence, memory_order_acquire) !=
+        lap + 1) {
         ret = -STIM_EAGAIN;
     } else {
-        queue->buffer[w] = *message;
-        queue->write_index = next;
-        stim_unlock(stim_lock_state);
+        *message = slot->message;
+        atomic_store_explicit(&slot->sequence, lap + STIM_QUEUE_SIZE,
+                              memory_order_release);
+        queue->read_index = r + 1;
+    }
+    return ret;
+}
+#endif
+#else
+/* The reserve and fill helpers expect the caller to hold stim_lock() */
+static int stim_queue_reserve(stim_queue_t *queue, unsigned int num,
+                              stim_index_t *index) {
+    int ret = 0;
+    stim_index_t free_slots;
+    free_slots = (queue->read_index - queue->write_index - 1) &
+                 (STIM_QUEUE_SIZE - 1);
+    if (num > free_slots) {
+        ret = -STIM_EAGAIN;
+    } else {
+        *index = queue->write_index;
+    }
+    return ret;
+}
+
+static void stim_queue_fill(stim_queue_t *queue, stim_index_t index,
+                            const stim_message_t *message) {
+    index &= STIM_QUEUE_SIZE - 1;
+    queue->buffer[index] = *message;
+    queue->write_index = (index + 1) & (STIM_QUEUE_SIZE - 1);
+}
+
+static int stim_queue_send(stim_queue_t *queue, const stim_message_t *message) {
+    int stim_lock_state;
+    int ret;
+    stim_index_t index;
+    stim_lock_state = stim_lock();
+    ret = stim_queue_reserve(queue, 1, &index);
+    if (!ret) {
+        stim_queue_fill(queue, index, message);
     }
     stim_unlock(stim_lock_state);
     return ret;
 }
 
+#if defined(STIM_STATS)
+/* Only meaningful in the consumer, which owns read_index */
+static unsigned int stim_queue_depth(stim_queue_t *queue) {
+    return (stim_index_t)(queue->write_index - queue->read_index) &
+           (STIM_QUEUE_SIZE - 1);
+}
+#endif
+
 static int stim_queue_receive(stim_queue_t *queue, stim_message_t *message) {
     int ret = 0;
-    uint8_t r;
+    stim_index_t r;
+#if defined(STIM_DISPATCH_WORKERS) ||                                          \
+    (!defined(STIM_ATOMIC_TICKS) && (STIM_QUEUE_SIZE > 256))
+    int stim_lock_state;
+    /*
+     * Dispatch workers share the read index, and multi-byte indices cannot
+     * be accessed atomically on small targets.
+     */
+    stim_lock_state = stim_lock();
+#endif
     r = queue->read_index;
     if (r == queue->write_index) {
         ret = -STIM_EAGAIN;
@@ -87,147 +442,1725 @@ static int stim_queue_receive(stim_queue_t *queue, stim_message_t *message) {
         *message = queue->buffer[r];
         queue->read_index = (r + 1) & (STIM_QUEUE_SIZE - 1);
     }
+#if defined(STIM_DISPATCH_WORKERS) ||                                          \
+    (!defined(STIM_ATOMIC_TICKS) && (STIM_QUEUE_SIZE > 256))
+    stim_unlock(stim_lock_state);
+#endif
     return ret;
 }
+#endif
 
-static void stim_list_add(stim_t *timer, uint32_t now) {
-    stim_t *entry;
-    stim_node_t *pos;
-    stim_node_t *node = &timer->node;
-    if (node->next == node) {
-        for (pos = list.next; pos != &list; pos = pos->next) {
-            entry = container_of(pos, stim_t, node);
-            if ((int32_t)(timer->expire_ticks - now) <
-                (int32_t)(entry->expire_ticks - now)) {
+#if !defined(STIM_SCHED_HEAP)
+static void stim_node_insert(stim_node_t *node, stim_node_t *pos) {
+    node->next = pos;
+    node->prev = pos->prev;
+    pos->prev->next = node;
+    pos->prev = node;
+}
+
+static void stim_node_remove(stim_node_t *node) {
+    node->prev->next = node->next;
+    node->next->prev = node->prev;
+    node->next = node;
+    node->prev = node;
+}
+#endif
+
+#if defined(STIM_SCHED_WHEEL)
+static uint32_t stim_ctz(uint32_t value) {
+#if defined(__GNUC__)
+    return (uint32_t)__builtin_ctz(value);
+#else
+    uint32_t n = 0;
+    while (!(value & 1)) {
+        value >>= 1;
+        ++n;
+    }
+    return n;
+#endif
+}
+
+static void stim_wheel_init(stim_wheel_t *wheel, stim_tick_t now) {
+    int i, j;
+    for (i = 0; i < STIM_WHEEL_ROOT_SIZE; ++i) {
+        wheel->root[i].next = &wheel->root[i];
+        wheel->root[i].prev = &wheel->root[i];
+    }
+    for (i = 0; i < STIM_WHEEL_LEVELS; ++i) {
+        for (j = 0; j < STIM_WHEEL_LEVEL_SIZE; ++j) {
+            wheel->level[i][j].next = &wheel->level[i][j];
+            wheel->level[i][j].prev = &wheel->level[i][j];
+        }
+    }
+    wheel->ready.next = &wheel->ready;
+    wheel->ready.prev = &wheel->ready;
+    memset(wheel->root_map, 0, sizeof(wheel->root_map));
+    memset(wheel->level_map, 0, sizeof(wheel->level_map));
+    wheel->ticks = now;
+    wheel->count = 0;
+}
+
+static void stim_wheel_place(stim_wheel_t *wheel, stim_t *timer,
+                             stim_tick_t now) {
+    int i;
+    uint32_t shift;
+    stim_tick_t expire = timer->expire_ticks;
+    stim_tick_t delta = expire - wheel->ticks;
+    stim_node_t *slot;
+    if ((stim_diff_t)(expire - now) < (stim_diff_t)(wheel->ticks - now)) {
+        /* Overdue timers go to the slot that is processed next */
+        expire = wheel->ticks;
+        delta = 0;
+    }
+    if (delta < STIM_WHEEL_ROOT_SIZE) {
+        expire &= STIM_WHEEL_ROOT_MASK;
+        wheel->root_map[expire >> 5] |= (uint32_t)1 << (expire & 31);
+        slot = &wheel->root[expire];
+    } else {
+        for (i = 0;; ++i) {
+            shift = STIM_WHEEL_ROOT_BITS + i * STIM_WHEEL_LEVEL_BITS;
+            if (i == STIM_WHEEL_LEVELS - 1 ||
+                delta < ((stim_tick_t)1 << (shift + STIM_WHEEL_LEVEL_BITS))) {
                 break;
             }
         }
-        node->next = pos;
-        node->prev = pos->prev;
-        pos->prev->next = node;
-        pos->prev = node;
+        expire = (expire >> shift) & STIM_WHEEL_LEVEL_MASK;
+        wheel->level_map[i][expire >> 5] |= (uint32_t)1 << (expire & 31);
+        slot = &wheel->level[i][expire];
     }
+    stim_node_insert(&timer->node, slot);
 }
 
-static void stim_list_del(stim_t *timer) {
-    stim_node_t *node = &timer->node;
-    if (node->next != node) {
-        node->prev->next = node->next;
-        node->next->prev = node->prev;
-        node->next = node;
-        node->prev = node;
+static void stim_wheel_cascade(stim_wheel_t *wheel, stim_tick_t now) {
+    int i;
+    uint32_t index;
+    stim_t *timer;
+    stim_node_t *slot;
+    for (i = 0; i < STIM_WHEEL_LEVELS; ++i) {
+        index = (wheel->ticks >>
+                 (STIM_WHEEL_ROOT_BITS + i * STIM_WHEEL_LEVEL_BITS)) &
+                STIM_WHEEL_LEVEL_MASK;
+        slot = &wheel->level[i][index];
+        while (slot->next != slot) {
+            timer = container_of(slot->next, stim_t, node);
+            stim_node_remove(&timer->node);
+            stim_wheel_place(wheel, timer, now);
+        }
+        wheel->level_map[i][index >> 5] &= ~((uint32_t)1 << (index & 31));
+        if (index) {
+            break;
+        }
     }
 }
 
-int stim_init(stim_t *timer, uint32_t period_ticks, stim_cb_mode_t cb_mode,
-              stim_cb_t cb, void *user_data) {
-    int ret = 0;
-    if (!timer || STIM_TICK_OUT_OF_RANGE(period_ticks)) {
-        ret = -STIM_EINVAL;
-    } else {
-        memset(timer, 0, sizeof(stim_t));
-        timer->period_ticks = period_ticks;
-        timer->cb = cb;
-        timer->user_data = user_data;
-        timer->cb_mode = cb_mode;
-        timer->state = STIM_STATE_STOPPED;
-        timer->node.next = &timer->node;
-        timer->node.prev = &timer->node;
+/*
+ * Distance in slots from index to the first occupied slot of a level. Bits
+ * of slots emptied by a stop stay set until the cascade, so the slot itself
+ * is checked as well.
+ */
+static int stim_wheel_level_next(const stim_wheel_t *wheel, int level,
+                                 uint32_t index, uint32_t *distance) {
+    uint32_t n;
+    uint32_t j;
+    uint32_t bits;
+    int found = 0;
+    for (n = 0; n < STIM_WHEEL_LEVEL_SIZE && !found;) {
+        j = (index + n) & STIM_WHEEL_LEVEL_MASK;
+        bits = wheel->level_map[level][j >> 5] >> (j & 31);
+        if (!bits) {
+            n += 32 - (j & 31);
+        } else {
+            n += stim_ctz(bits);
+            j = (index + n) & STIM_WHEEL_LEVEL_MASK;
+            if (n < STIM_WHEEL_LEVEL_SIZE &&
+                wheel->level[level][j].next != &wheel->level[level][j]) {
+                *distance = n;
+                found = 1;
+            }
+            ++n;
+        }
     }
-    return ret;
+    return found;
 }
 
-int stim_start(stim_t *timer) {
-    int ret = 0;
-    stim_message_t message;
-    if (!timer) {
-        ret = -STIM_EINVAL;
-    } else {
-        message.timer = timer;
-        message.command = STIM_COMMAND_START;
-        ret = stim_queue_send(&stim_command_queue, &message);
+/*
+ * Find the first cascade point at or after the root boundary next that has
+ * work to do. A slot of level i is only cascaded at ticks that are multiples
+ * of its slot width, so the earliest such tick is taken over every occupied
+ * slot of every level, and long idle advances do not visit each boundary.
+ */
+static stim_tick_t stim_wheel_skip(const stim_wheel_t *wheel,
+                                   stim_tick_t next) {
+    int i;
+    uint32_t j;
+    uint32_t index;
+    uint32_t shift;
+    stim_tick_t base;
+    stim_tick_t ticks;
+    stim_tick_t step = 0;
+    int busy = 0;
+    int found = 0;
+    for (j = 0; j < STIM_WHEEL_ROOT_SIZE / 32 && !busy; ++j) {
+        /* Root slots of the next rotation are reached through next */
+        busy = wheel->root_map[j] != 0;
     }
-    return ret;
+    for (i = 0; i < STIM_WHEEL_LEVELS && !busy; ++i) {
+        shift = STIM_WHEEL_ROOT_BITS + i * STIM_WHEEL_LEVEL_BITS;
+        base = ((next - 1) | (((stim_tick_t)1 << shift) - 1)) + 1;
+        index = (uint32_t)(base >> shift) & STIM_WHEEL_LEVEL_MASK;
+        if (stim_wheel_level_next(wheel, i, index, &j)) {
+            ticks = base - next + ((stim_tick_t)j << shift);
+            if (!found || ticks < step) {
+                step = ticks;
+                found = 1;
+            }
+        }
+    }
+    return next + step;
 }
 
-int stim_stop(stim_t *timer) {
-    int ret = 0;
-    stim_message_t message;
-    if (!timer) {
-        ret = -STIM_EINVAL;
-    } else {
-        message.timer = timer;
-        message.command = STIM_COMMAND_STOP;
-        ret = stim_queue_send(&stim_command_queue, &message);
+static void stim_wheel_advance(stim_wheel_t *wheel, stim_tick_t now) {
+    uint32_t index;
+    stim_tick_t step;
+    uint32_t bits;
+    stim_node_t *slot;
+    if (!wheel->count) {
+        /* An idle wheel may have been left behind by any amount of ticks */
+        wheel->ticks = now + 1;
+    }
+    while (wheel->ready.next == &wheel->ready &&
+           (stim_diff_t)(now - wheel->ticks) >= 0) {
+        index = wheel->ticks & STIM_WHEEL_ROOT_MASK;
+        if (!index) {
+            stim_wheel_cascade(wheel, now);
+        }
+        slot = &wheel->root[index];
+        wheel->root_map[index >> 5] &= ~((uint32_t)1 << (index & 31));
+        if (slot->next != slot) {
+            /* Splice the whole slot onto the ready list */
+            slot->next->prev = wheel->ready.prev;
+            slot->prev->next = &wheel->ready;
+            wheel->ready.prev->next = slot->next;
+            wheel->ready.prev = slot->prev;
+            slot->next = slot;
+            slot->prev = slot;
+            ++wheel->ticks;
+            break;
+        }
+        /*
+         * Skip empty slots up to the next occupied one, the next cascade
+         * point or the current tick, whichever comes first.
+         */
+        step = STIM_WHEEL_ROOT_SIZE - index;
+        for (++index; index < STIM_WHEEL_ROOT_SIZE; index = (index | 31) + 1) {
+            bits = wheel->root_map[index >> 5] >> (index & 31);
+            if (bits) {
+                index += stim_ctz(bits);
+                step = index - (wheel->ticks & STIM_WHEEL_ROOT_MASK);
+                break;
+            }
+        }
+        if (index >= STIM_WHEEL_ROOT_SIZE) {
+            step = stim_wheel_skip(wheel, wheel->ticks + step) - wheel->ticks;
+        }
+        if (now - wheel->ticks + 1 < step) {
+            step = now - wheel->ticks + 1;
+        }
+        wheel->ticks += step;
     }
-    return ret;
 }
 
-static void stim_process_commands(uint32_t now) {
-    stim_message_t message;
-    while (!stim_queue_receive(&stim_command_queue, &message)) {
-        if (message.command == STIM_COMMAND_START &&
-            message.timer->state == STIM_STATE_STOPPED) {
-            message.timer->state = STIM_STATE_RUNNING;
-            message.timer->expire_ticks = message.timer->period_ticks + now;
-            stim_list_add(message.timer, now);
-        } else if (message.command == STIM_COMMAND_STOP &&
-                   message.timer->state == STIM_STATE_RUNNING) {
-            message.timer->state = STIM_STATE_STOPPED;
-            stim_list_del(message.timer);
+static int stim_wheel_slot_first(const stim_node_t *slot, stim_tick_t base,
+                                 stim_tick_t *expire) {
+    int found = 0;
+    stim_tick_t ticks;
+    const stim_node_t *pos;
+    for (pos = slot->next; pos != slot; pos = pos->next) {
+        ticks = container_of(pos, stim_t, node)->expire_ticks;
+        if (!found ||
+            (stim_diff_t)(ticks - base) < (stim_diff_t)(*expire - base)) {
+            *expire = ticks;
+            found = 1;
         }
     }
+    return found;
 }
 
-int stim_poll(void) {
-    int stim_lock_state;
-    int ret = 0;
-    stim_t *timer;
-    stim_message_t message;
-    uint32_t now = stim_get_ticks();
-    stim_process_commands(now);
-    while (list.next != &list) {
-        timer = container_of(list.next, stim_t, node);
-        if ((int32_t)(timer->expire_ticks - now) <= 0) {
-            stim_list_del(timer);
-            timer->expire_ticks += timer->period_ticks;
-            stim_lock_state = stim_lock();
-            ++timer->count;
-            stim_unlock(stim_lock_state);
-            stim_list_add(timer, now);
-            if (timer->cb) {
-                if (timer->cb_mode == STIM_CB_MODE_IMMEDIATE) {
-                    timer->cb(timer, timer->user_data);
-                } else {
-                    message.timer = timer;
-                    ret |= stim_queue_send(&stim_expired_queue, &message);
+static int stim_wheel_first(const stim_wheel_t *wheel, stim_tick_t *expire) {
+    int i;
+    int found = 0;
+    uint32_t j;
+    uint32_t shift;
+    uint32_t index;
+    uint32_t start;
+    stim_tick_t ticks;
+    if (!wheel->ready.next || !wheel->count) {
+        found = 0;
+    } else if (wheel->ready.next != &wheel->ready) {
+        *expire = container_of(wheel->ready.next, stim_t, node)->expire_ticks;
+        found = 1;
+    } else {
+        for (j = 0; j < STIM_WHEEL_ROOT_SIZE; ++j) {
+            index = (wheel->ticks + j) & STIM_WHEEL_ROOT_MASK;
+            if (((wheel->root_map[index >> 5] >> (index & 31)) & 1) &&
+                stim_wheel_slot_first(&wheel->root[index], wheel->ticks,
+                                      expire)) {
+                found = 1;
+                break;
+            }
+        }
+        /*
+         * Slots of a level are ordered in time starting after the cursor, or
+         * at the cursor when it sits on a boundary that has not been cascaded
+         * yet, so only the first occupied slot of each level is inspected.
+         */
+        for (i = 0; i < STIM_WHEEL_LEVELS; ++i) {
+            shift = STIM_WHEEL_ROOT_BITS + i * STIM_WHEEL_LEVEL_BITS;
+            start = (wheel->ticks & (((stim_tick_t)1 << shift) - 1)) ? 1 : 0;
+            for (j = start; j < start + STIM_WHEEL_LEVEL_SIZE; ++j) {
+                index = ((wheel->ticks >> shift) + j) & STIM_WHEEL_LEVEL_MASK;
+                if (stim_wheel_slot_first(&wheel->level[i][index],
+                                          wheel->ticks, &ticks)) {
+                    if (!found || (stim_diff_t)(ticks - wheel->ticks) <
+                                      (stim_diff_t)(*expire - wheel->ticks)) {
+                        *expire = ticks;
+                        found = 1;
+                    }
+                    break;
                 }
             }
-        } else {
-            break;
         }
     }
-    return ret;
+    return found;
 }
 
-void stim_dispatch(uint8_t max_event_num) {
-    stim_message_t message;
-    while (max_event_num-- &&
-           !stim_queue_receive(&stim_expired_queue, &message))
-        if (message.timer->cb) {
-            message.timer->cb(message.timer, message.timer->user_data);
+static void stim_list_add(stim_sched_t *sched, stim_t *timer,
+                          stim_tick_t now) {
+    if (!sched->wheel.ready.next) {
+        stim_wheel_init(&sched->wheel, now);
+    } else if (!sched->wheel.count) {
+        /* Resync the cursor after an idle jump of any length */
+        sched->wheel.ticks = now;
+    }
+    if (timer->node.next == &timer->node) {
+        STIM_TRACE_INSERT(sched, timer);
+        stim_wheel_place(&sched->wheel, timer, now);
+        ++sched->wheel.count;
+    }
+}
+
+static void stim_list_del(stim_sched_t *sched, stim_t *timer) {
+    if (timer->node.next != &timer->node) {
+        STIM_TRACE_REMOVE(sched, timer);
+        stim_node_remove(&timer->node);
+        --sched->wheel.count;
+    }
+}
+
+static stim_t *stim_list_pop(stim_sched_t *sched, stim_tick_t now) {
+    stim_t *timer = NULL;
+    if (!sched->wheel.ready.next) {
+        stim_wheel_init(&sched->wheel, now);
+    }
+    stim_wheel_advance(&sched->wheel, now);
+    if (sched->wheel.ready.next != &sched->wheel.ready) {
+        timer = container_of(sched->wheel.ready.next, stim_t, node);
+        stim_list_del(sched, timer);
+    }
+    return timer;
+}
+static int stim_list_first(stim_sched_t *sched, stim_tick_t *expire) {
+    return stim_wheel_first(&sched->wheel, expire);
+}
+#elif defined(STIM_SCHED_HEAP)
+static int stim_heap_before(const stim_sched_t *sched, const stim_node_t *a,
+                            const stim_node_t *b) {
+    stim_tick_t now = sched->heap_now;
+    return (stim_diff_t)(container_of(a, stim_t, node)->expire_ticks - now) <
+           (stim_diff_t)(container_of(b, stim_t, node)->expire_ticks - now);
+}
+
+static stim_node_t *stim_heap_meld(stim_sched_t *sched, stim_node_t *a,
+                                   stim_node_t *b) {
+    stim_node_t *tmp;
+    if (!a) {
+        return b;
+    }
+    if (!b) {
+        return a;
+    }
+    if (stim_heap_before(sched, b, a)) {
+        tmp = a;
+        a = b;
+        b = tmp;
+    }
+    b->next = a->child;
+    if (a->child) {
+        a->child->prev = b;
+    }
+    b->prev = a;
+    a->child = b;
+    return a;
+}
+
+static stim_node_t *stim_heap_merge_pairs(stim_sched_t *sched,
+                                          stim_node_t *first) {
+    stim_node_t *a;
+    stim_node_t *b;
+    stim_node_t *pairs = NULL;
+    stim_node_t *root = NULL;
+    /* First pass: meld siblings pairwise, stacking the results */
+    while (first) {
+        a = first;
+        b = a->next;
+        first = b ? b->next : NULL;
+        a->next = NULL;
+        if (b) {
+            b->next = NULL;
+            a = stim_heap_meld(sched, a, b);
         }
+        a->prev = pairs;
+        pairs = a;
+    }
+    /* Second pass: meld the stacked pairs from right to left */
+    while (pairs) {
+        a = pairs;
+        pairs = a->prev;
+        a->prev = NULL;
+        root = stim_heap_meld(sched, root, a);
+    }
+    return root;
 }
 
-int stim_set_count(stim_t *timer, uint32_t count) {
-    int stim_lock_state;
-    int ret = 0;
-    if (!timer) {
-        ret = -STIM_EINVAL;
-    } else {
-        stim_lock_state = stim_lock();
-        timer->count = count;
-        stim_unlock(stim_lock_state);
+static void stim_list_add(stim_sched_t *sched, stim_t *timer,
+                          stim_tick_t now) {
+    stim_node_t *node = &timer->node;
+    if (node->next == node) {
+        STIM_TRACE_INSERT(sched, timer);
+        sched->heap_now = now;
+        node->next = NULL;
+        node->prev = NULL;
+        node->child = NULL;
+        sched->heap = stim_heap_meld(sched, sched->heap, node);
+    }
+}
+
+static void stim_list_del(stim_sched_t *sched, stim_t *timer) {
+    stim_node_t *node = &timer->node;
+    stim_node_t *sub;
+    if (node->next != node) {
+        STIM_TRACE_REMOVE(sched, timer);
+        if (node == sched->heap) {
+            sched->heap = stim_heap_merge_pairs(sched, node->child);
+        } else {
+            if (node->prev->child == node) {
+                node->prev->child = node->next;
+            } else {
+                node->prev->next = node->next;
+            }
+            if (node->next) {
+                node->next->prev = node->prev;
+            }
+            sub = stim_heap_merge_pairs(sched, node->child);
+            sched->heap = stim_heap_meld(sched, sched->heap, sub);
+        }
+        node->next = node;
+        node->prev = node;
+        node->child = NULL;
+    }
+}
+
+static stim_t *stim_list_pop(stim_sched_t *sched, stim_tick_t now) {
+    stim_t *timer = NULL;
+    if (sched->heap) {
+        sched->heap_now = now;
+        timer = container_of(sched->heap, stim_t, node);
+        if ((stim_diff_t)(timer->expire_ticks - now) <= 0) {
+            stim_list_del(sched, timer);
+        } else {
+            timer = NULL;
+        }
+    }
+    return timer;
+}
+
+static int stim_list_first(stim_sched_t *sched, stim_tick_t *expire) {
+    int found = 0;
+    if (sched->heap) {
+        *expire = container_of(sched->heap, stim_t, node)->expire_ticks;
+        found = 1;
+    }
+    return found;
+}
+#else
+static int stim_list_before(const stim_node_t *a, const stim_node_t *b,
+                            stim_tick_t now) {
+    return (stim_diff_t)(container_of(a, stim_t, node)->expire_ticks - now) <
+           (stim_diff_t)(container_of(b, stim_t, node)->expire_ticks - now);
+}
+
+static void stim_list_add(stim_sched_t *sched, stim_t *timer,
+                          stim_tick_t now) {
+    stim_node_t *pos;
+    stim_node_t *node = &timer->node;
+#if defined(STIM_STATS)
+    uint32_t walk = 0;
+#endif
+    if (node->next == node) {
+        STIM_TRACE_INSERT(sched, timer);
+        if (sched->batch) {
+            /* Sorted and merged by stim_list_merge() */
+            stim_node_insert(node, sched->batch);
+        } else {
+            for (pos = sched->list.next; pos != &sched->list;
+                 pos = pos->next) {
+                if (stim_list_before(node, pos, now)) {
+                    break;
+                }
+#if defined(STIM_STATS)
+                ++walk;
+#endif
+            }
+            stim_node_insert(node, pos);
+            STIM_STATS_ADD(sched, list_adds, 1);
+            STIM_STATS_ADD(sched, list_walk_total, walk);
+            STIM_STATS_MAX(sched, list_walk_max, walk);
+        }
+    }
+}
+
+/* Merge two NULL terminated chains, a goes first on equal deadlines */
+static stim_node_t *stim_list_join(stim_node_t *a, stim_node_t *b,
+                                   stim_tick_t now) {
+    stim_node_t head;
+    stim_node_t *tail = &head;
+    while (a && b) {
+        if (stim_list_before(b, a, now)) {
+            tail->next = b;
+            b = b->next;
+        } else {
+            tail->next = a;
+            a = a->next;
+        }
+        tail = tail->next;
+    }
+    tail->next = a ? a : b;
+    return head.next;
+}
+
+/*
+ * Stable bottom-up merge sort, bins[i] holds a sorted run of 2^i nodes. The
+ * last bin absorbs everything beyond that, which only costs balance.
+ */
+static stim_node_t *stim_list_sort(stim_node_t *chain, stim_tick_t now) {
+    int i;
+    stim_node_t *node;
+    stim_node_t *bins[16];
+    for (i = 0; i < 16; ++i) {
+        bins[i] = NULL;
+    }
+    while (chain) {
+        node = chain;
+        chain = chain->next;
+        node->next = NULL;
+        for (i = 0; i < 15 && bins[i]; ++i) {
+            node = stim_list_join(bins[i], node, now);
+            bins[i] = NULL;
+        }
+        bins[i] = stim_list_join(bins[i], node, now);
+    }
+    node = NULL;
+    for (i = 0; i < 16; ++i) {
+        node = stim_list_join(bins[i], node, now);
+    }
+    return node;
+}
+
+/* Sort the batched timers and merge them into the list in one pass */
+static void stim_list_merge(stim_sched_t *sched, stim_node_t *batch,
+                            stim_tick_t now) {
+    stim_node_t *node;
+    stim_node_t *next;
+    stim_node_t *pos = sched->list.next;
+#if defined(STIM_STATS)
+    uint32_t walk;
+#endif
+    if (batch->next != batch) {
+        batch->prev->next = NULL;
+        node = stim_list_sort(batch->next, now);
+        while (node) {
+            next = node->next;
+#if defined(STIM_STATS)
+            walk = 0;
+#endif
+            while (pos != &sched->list && !stim_list_before(node, pos, now)) {
+                pos = pos->next;
+#if defined(STIM_STATS)
+                ++walk;
+#endif
+            }
+            stim_node_insert(node, pos);
+            STIM_STATS_ADD(sched, list_adds, 1);
+            STIM_STATS_ADD(sched, list_walk_total, walk);
+            STIM_STATS_MAX(sched, list_walk_max, walk);
+            node = next;
+        }
+    }
+}
+
+static void stim_list_del(stim_sched_t *sched, stim_t *timer) {
+    stim_node_t *node = &timer->node;
+    (void)sched;
+    if (node->next != node) {
+        STIM_TRACE_REMOVE(sched, timer);
+        stim_node_remove(node);
+    }
+}
+
+static stim_t *stim_list_pop(stim_sched_t *sched, stim_tick_t now) {
+    stim_t *timer = NULL;
+    if (sched->list.next != &sched->list) {
+        timer = container_of(sched->list.next, stim_t, node);
+        if ((stim_diff_t)(timer->expire_ticks - now) <= 0) {
+            stim_list_del(sched, timer);
+        } else {
+            timer = NULL;
+        }
+    }
+    return timer;
+}
+
+static int stim_list_first(stim_sched_t *sched, stim_tick_t *expire) {
+    int found = 0;
+    if (sched->list.next != &sched->list) {
+        *expire = container_of(sched->list.next, stim_t, node)->expire_ticks;
+        found = 1;
+    }
+    return found;
+}
+#endif
+
+int stim_sched_init(stim_sched_t *sched) {
+    int ret = 0;
+    if (!sched) {
+        ret = -STIM_EINVAL;
+    } else {
+        memset(sched, 0, sizeof(stim_sched_t));
+#if defined(STIM_SCHED_WHEEL)
+        stim_wheel_init(&sched->wheel, stim_get_ticks(sched));
+#elif !defined(STIM_SCHED_HEAP)
+        sched->list.next = &sched->list;
+        sched->list.prev = &sched->list;
+#endif
+#if defined(STIM_DISPATCH_WAIT)
+        sched->event_fd = -1;
+#endif
+#if defined(STIM_POLL_WAIT)
+        sched->poll_fd = -1;
+        sched->command_fd = -1;
+        sched->timer_fd = -1;
+#endif
+    }
+    return ret;
+}
+
+/*
+ * Close the descriptors created on first use by the blocking dispatch and
+ * the poll loop. No other context may use the scheduler at the same time.
+ */
+int stim_sched_deinit(stim_sched_t *sched) {
+    int ret = 0;
+    if (!sched) {
+        ret = -STIM_EINVAL;
+    } else {
+#if defined(STIM_DISPATCH_WAIT)
+        if (sched->event_fd >= 0) {
+            close(sched->event_fd);
+            sched->event_fd = -1;
+        }
+#endif
+#if defined(STIM_POLL_WAIT)
+        if (sched->poll_fd >= 0) {
+            close(sched->poll_fd);
+            close(sched->timer_fd);
+            close(sched->command_fd);
+            sched->poll_fd = -1;
+            sched->command_fd = -1;
+            sched->timer_fd = -1;
+        }
+#endif
+    }
+    return ret;
+}
+
+int stim_sched_timer_init(stim_sched_t *sched, stim_t *timer,
+                          stim_tick_t period_ticks, stim_cb_mode_t cb_mode,
+                          stim_cb_t cb, void *user_data) {
+    int ret = 0;
+    if (!sched || !timer || STIM_TICK_OUT_OF_RANGE(period_ticks)) {
+        ret = -STIM_EINVAL;
+    } else {
+        memset(timer, 0, sizeof(stim_t));
+        timer->sched = sched;
+        timer->period_ticks = period_ticks;
+        timer->cb = cb;
+        timer->user_data = user_data;
+        timer->cb_mode = cb_mode;
+        timer->mode = STIM_MODE_PERIODIC;
+        timer->state = STIM_STATE_STOPPED;
+        timer->node.next = &timer->node;
+        timer->node.prev = &timer->node;
+    }
+    return ret;
+}
+
+int stim_init(stim_t *timer, stim_tick_t period_ticks, stim_cb_mode_t cb_mode,
+              stim_cb_t cb, void *user_data) {
+    return stim_sched_timer_init(&stim_default_sched, timer, period_ticks,
+                                 cb_mode, cb, user_data);
+}
+
+/* A stop replaces a pending start, a start is added to a pending stop */
+static uint8_t stim_merge_command(uint8_t pending, uint8_t command) {
+    return (command & STIM_COMMAND_STOP) ? command : pending | command;
+}
+
+#if defined(STIM_LOCKFREE_QUEUE)
+/*
+ * Record the command in every timer and queue only the timers that had none
+ * pending, so every timer takes at most one command queue entry. The slot is
+ * only changed by CAS, and the producer that finds it empty owns the entry.
+ * Entries are reserved before a slot is claimed, so a full queue never
+ * leaves a command without an entry, and entries that turn out not to be
+ * needed are published empty. If the poll takes a command between the
+ * counting and the claim and the queue is full, a batch is posted in part.
+ */
+static int stim_post_commands(stim_t *const *timers, size_t num,
+                              uint8_t command, stim_tick_t ticks) {
+    int ret = 0;
+    size_t i;
+    unsigned int queued = 0;
+    unsigned int index = 0;
+    unsigned char pending;
+    stim_sched_t *sched = timers[0]->sched;
+    stim_message_t message;
+#if defined(STIM_POLL_WAIT)
+    int posted = 0;
+#endif
+#if defined(STIM_LAZY_CANCEL)
+    if (command == STIM_COMMAND_STOP) {
+        /*
+         * Reuse the queue entry of a pending command, otherwise only leave
+         * a tombstone that the poll drops the timer at.
+         */
+        for (i = 0; i < num; ++i) {
+            STIM_TRACE_COMMAND_POST(sched, timers[i], command);
+            pending = atomic_load(&timers[i]->command);
+            while (pending && !atomic_compare_exchange_weak(
+                                  &timers[i]->command, &pending,
+                                  STIM_COMMAND_STOP)) {
+            }
+            if (!pending) {
+                atomic_store(&timers[i]->cancelled, 1);
+            }
+        }
+        num = 0;
+    }
+#endif
+    for (i = 0; i < num; ++i) {
+        if (!atomic_load(&timers[i]->command)) {
+            ++queued;
+        }
+    }
+    if (queued) {
+        ret = stim_queue_reserve(&sched->command_queue, queued, &index);
+        if (ret) {
+            queued = 0;
+        }
+    }
+    message.ticks = 0;
+    for (i = 0; i < num && !ret; ++i) {
+        if (command & STIM_COMMAND_START) {
+            atomic_store_explicit(&timers[i]->command_ticks, ticks,
+                                  memory_order_relaxed);
+        }
+        pending = atomic_load(&timers[i]->command);
+        while (!ret) {
+            if (!pending && !queued) {
+                /* Taken by the poll since it was counted */
+                ret = stim_queue_reserve(&sched->command_queue, 1, &index);
+                queued = !ret;
+            } else if (atomic_compare_exchange_weak(
+                           &timers[i]->command, &pending,
+                           stim_merge_command(pending, command))) {
+                break;
+            }
+        }
+        if (!ret) {
+            STIM_TRACE_COMMAND_POST(sched, timers[i], command);
+        }
+        if (!ret && !pending) {
+            message.timer = timers[i];
+            stim_queue_fill(&sched->command_queue, index++, &message);
+            --queued;
+#if defined(STIM_POLL_WAIT)
+            posted = 1;
+#endif
+        }
+    }
+#if defined(STIM_STATS)
+    if (ret) {
+        atomic_fetch_add(&sched->command_rejects, 1);
+    }
+#endif
+    message.timer = NULL;
+    for (; queued; --queued) {
+        stim_queue_fill(&sched->command_queue, index++, &message);
+    }
+#if defined(STIM_POLL_WAIT)
+    if (posted) {
+        stim_poll_notify(sched);
+    }
+#endif
+    return ret;
+}
+#else
+/* Marks the timers of a batch that need a new command queue entry */
+#define STIM_COMMAND_QUEUED 0x80
+
+static void stim_set_command(stim_t *timer, uint8_t command,
+                             stim_tick_t ticks) {
+    timer->command = stim_merge_command(timer->command, command);
+    if (command & STIM_COMMAND_START) {
+        timer->command_ticks = ticks;
+    }
+}
+
+/*
+ * Record the command in every timer and queue only the timers that had none
+ * pending, so every timer takes at most one command queue entry. The entries
+ * of a batch are reserved at once, if they do not fit nothing is posted.
+ */
+static int stim_post_commands(stim_t *const *timers, size_t num,
+                              uint8_t command, stim_tick_t ticks) {
+    int stim_lock_state;
+    int ret = 0;
+    size_t i;
+    size_t queued = 0;
+    stim_index_t index = 0;
+    stim_message_t message;
+    stim_lock_state = stim_lock();
+#if defined(STIM_LAZY_CANCEL)
+    if (command == STIM_COMMAND_STOP) {
+        /*
+         * Reuse the queue entry of a pending command, otherwise only leave
+         * a tombstone that the poll drops the timer at.
+         */
+        for (i = 0; i < num; ++i) {
+            STIM_TRACE_COMMAND_POST(timers[i]->sched, timers[i], command);
+            if (timers[i]->command) {
+                timers[i]->command = STIM_COMMAND_STOP;
+            } else {
+                timers[i]->cancelled = 1;
+            }
+        }
+        num = 0;
+    }
+#endif
+    for (i = 0; i < num; ++i) {
+        if (!timers[i]->command) {
+            timers[i]->command = STIM_COMMAND_QUEUED;
+            ++queued;
+        }
+    }
+    if (queued) {
+        ret = stim_queue_reserve(&timers[0]->sched->command_queue,
+                                 (unsigned int)queued, &index);
+        if (ret) {
+            STIM_STATS_ADD(timers[0]->sched, command_rejects, 1);
+        }
+    }
+    message.ticks = 0;
+    for (i = 0; i < num; ++i) {
+        if (timers[i]->command == STIM_COMMAND_QUEUED) {
+            timers[i]->command = 0;
+            if (!ret) {
+                STIM_TRACE_COMMAND_POST(timers[i]->sched, timers[i], command);
+                stim_set_command(timers[i], command, ticks);
+                message.timer = timers[i];
+                stim_queue_fill(&timers[i]->sched->command_queue, index++,
+                                &message);
+            }
+        } else if (!ret) {
+            STIM_TRACE_COMMAND_POST(timers[i]->sched, timers[i], command);
+            stim_set_command(timers[i], command, ticks);
+        }
+    }
+    stim_unlock(stim_lock_state);
+#if defined(STIM_POLL_WAIT)
+    if (queued && !ret) {
+        stim_poll_notify(timers[0]->sched);
+    }
+#endif
+    return ret;
+}
+#endif
+
+/* A batch above the queue capacity could never be posted, retry or not */
+static int stim_check_batch(stim_t *const *timers, size_t num) {
+    int ret = 0;
+    size_t i;
+    if (!timers || num > STIM_QUEUE_CAPACITY) {
+        ret = -STIM_EINVAL;
+    }
+    for (i = 0; i < num && !ret; ++i) {
+        if (!timers[i] || timers[i]->sched != timers[0]->sched) {
+            ret = -STIM_EINVAL;
+        }
+    }
+    return ret;
+}
+
+int stim_start(stim_t *timer) {
+    int ret = 0;
+    if (!timer) {
+        ret = -STIM_EINVAL;
+    } else {
+        ret = stim_post_commands(&timer, 1, STIM_COMMAND_START, 0);
+    }
+    return ret;
+}
+
+int stim_start_after(stim_t *timer, stim_tick_t delay_ticks) {
+    int ret = 0;
+    if (!timer || STIM_TICK_OUT_OF_RANGE(delay_ticks)) {
+        ret = -STIM_EINVAL;
+    } else {
+        ret = stim_post_commands(&timer, 1, STIM_COMMAND_START, delay_ticks);
+    }
+    return ret;
+}
+
+int stim_stop(stim_t *timer) {
+    int ret = 0;
+    if (!timer) {
+        ret = -STIM_EINVAL;
+    } else {
+        ret = stim_post_commands(&timer, 1, STIM_COMMAND_STOP, 0);
+    }
+    return ret;
+}
+
+int stim_start_many(stim_t *const *timers, size_t num) {
+    int ret = stim_check_batch(timers, num);
+    if (!ret && num) {
+        ret = stim_post_commands(timers, num, STIM_COMMAND_START, 0);
+    }
+    return ret;
+}
+
+int stim_stop_many(stim_t *const *timers, size_t num) {
+    int ret = stim_check_batch(timers, num);
+    if (!ret && num) {
+        ret = stim_post_commands(timers, num, STIM_COMMAND_STOP, 0);
+    }
+    return ret;
+}
+
+int stim_restart(stim_t *timer) {
+    int ret = 0;
+    if (!timer) {
+        ret = -STIM_EINVAL;
+    } else {
+        ret = stim_post_commands(&timer, 1, STIM_COMMAND_RESTART, 0);
+    }
+    return ret;
+}
+
+static void stim_apply_start(stim_sched_t *sched, stim_t *timer,
+                             stim_tick_t delay_ticks, stim_tick_t now) {
+    if (timer->state == STIM_STATE_STOPPED) {
+        timer->state = STIM_STATE_RUNNING;
+        timer->expire_ticks =
+            (delay_ticks ? delay_ticks : timer->period_ticks) + now;
+#if defined(STIM_LAZY_RESTART)
+        timer->deadline_ticks = timer->expire_ticks;
+#endif
+        stim_list_add(sched, timer, now);
+    }
+}
+
+static void stim_apply_restart(stim_sched_t *sched, stim_t *timer,
+                               stim_tick_t delay_ticks, stim_tick_t now) {
+    stim_tick_t expire =
+        (delay_ticks ? delay_ticks : timer->period_ticks) + now;
+#if defined(STIM_LAZY_RESTART)
+    /*
+     * A later deadline is only recorded, the node is moved once its stale
+     * position reaches the head. An earlier one must be sorted in now.
+     */
+    timer->deadline_ticks = expire;
+    if ((stim_diff_t)(expire - timer->expire_ticks) < 0) {
+        stim_list_del(sched, timer);
+        timer->expire_ticks = expire;
+        stim_list_add(sched, timer, now);
+    }
+#else
+    stim_list_del(sched, timer);
+    timer->expire_ticks = expire;
+    stim_list_add(sched, timer, now);
+#endif
+}
+
+static void stim_apply_stop(stim_sched_t *sched, stim_t *timer) {
+    if (timer->state == STIM_STATE_RUNNING) {
+        timer->state = STIM_STATE_STOPPED;
+        stim_list_del(sched, timer);
+    }
+}
+
+#if defined(STIM_LAZY_CANCEL)
+static int stim_apply_cancel(stim_sched_t *sched, stim_t *timer) {
+#if defined(STIM_LOCKFREE_QUEUE)
+    int cancelled = atomic_exchange(&timer->cancelled, 0);
+    if (cancelled) {
+        stim_apply_stop(sched, timer);
+    }
+#else
+    int stim_lock_state;
+    int cancelled = timer->cancelled;
+    if (cancelled) {
+        stim_lock_state = stim_lock();
+        timer->cancelled = 0;
+        stim_unlock(stim_lock_state);
+        stim_apply_stop(sched, timer);
+    }
+#endif
+    return cancelled;
+}
+#endif
+
+static void stim_process_commands(stim_sched_t *sched, stim_tick_t now) {
+#if !defined(STIM_LOCKFREE_QUEUE)
+    int stim_lock_state;
+#endif
+    uint8_t command;
+    stim_tick_t ticks;
+    stim_message_t message;
+#if !defined(STIM_SCHED_WHEEL) && !defined(STIM_SCHED_HEAP)
+    stim_node_t batch;
+    batch.next = &batch;
+    batch.prev = &batch;
+    sched->batch = &batch;
+#endif
+    STIM_STATS_MAX(sched, command_peak,
+                   stim_queue_depth(&sched->command_queue));
+    while (!stim_queue_receive(&sched->command_queue, &message)) {
+#if defined(STIM_LOCKFREE_QUEUE)
+        if (!message.timer) {
+            /* Reserved by a producer that found the timer queued already */
+            continue;
+        }
+#endif
+        STIM_STATS_ADD(sched, commands, 1);
+#if defined(STIM_LAZY_CANCEL)
+        stim_apply_cancel(sched, message.timer);
+#endif
+#if defined(STIM_LOCKFREE_QUEUE)
+        command = (uint8_t)atomic_exchange(&message.timer->command, 0);
+        ticks = atomic_load_explicit(&message.timer->command_ticks,
+                                     memory_order_relaxed);
+#else
+        stim_lock_state = stim_lock();
+        command = message.timer->command;
+        ticks = message.timer->command_ticks;
+        message.timer->command = 0;
+        stim_unlock(stim_lock_state);
+#endif
+        STIM_TRACE_COMMAND_TAKE(sched, message.timer, command);
+        if (command == STIM_COMMAND_RESTART &&
+            message.timer->state == STIM_STATE_RUNNING) {
+            stim_apply_restart(sched, message.timer, ticks, now);
+        } else {
+            if (command & STIM_COMMAND_STOP) {
+                stim_apply_stop(sched, message.timer);
+            }
+            if (command & STIM_COMMAND_START) {
+                stim_apply_start(sched, message.timer, ticks, now);
+            }
+        }
+    }
+#if !defined(STIM_SCHED_WHEEL) && !defined(STIM_SCHED_HEAP)
+    sched->batch = NULL;
+    stim_list_merge(sched, &batch, now);
+#endif
+}
+
+int stim_start_sync(stim_t *timer) {
+    int ret = 0;
+    stim_tick_t now;
+    if (!timer) {
+        ret = -STIM_EINVAL;
+    } else {
+        now = stim_get_ticks(timer->sched);
+        /* Commands posted earlier must not overtake this one */
+        stim_process_commands(timer->sched, now);
+#if defined(STIM_LAZY_CANCEL)
+        stim_apply_cancel(timer->sched, timer);
+#endif
+        stim_apply_start(timer->sched, timer, 0, now);
+    }
+    return ret;
+}
+
+int stim_stop_sync(stim_t *timer) {
+    int ret = 0;
+    if (!timer) {
+        ret = -STIM_EINVAL;
+    } else {
+        stim_process_commands(timer->sched, stim_get_ticks(timer->sched));
+#if defined(STIM_LAZY_CANCEL)
+        stim_apply_cancel(timer->sched, timer);
+#endif
+        stim_apply_stop(timer->sched, timer);
+    }
+    return ret;
+}
+
+#if defined(STIM_DISPATCH_WAIT)
+/* Created on first use by whichever of poll and dispatch comes first */
+static int stim_event_fd(stim_sched_t *sched) {
+#if defined(STIM_LOCKFREE_QUEUE)
+    int expected = -1;
+    int fd = atomic_load(&sched->event_fd);
+    if (fd < 0) {
+        fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (fd >= 0 &&
+            !atomic_compare_exchange_strong(&sched->event_fd, &expected, fd)) {
+            /* Another context published its descriptor first */
+            close(fd);
+            fd = expected;
+        }
+    }
+#else
+    int stim_lock_state;
+    int fd = sched->event_fd;
+    if (fd < 0) {
+        stim_lock_state = stim_lock();
+        if (sched->event_fd < 0) {
+            sched->event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        }
+        fd = sched->event_fd;
+        stim_unlock(stim_lock_state);
+    }
+#endif
+    return fd;
+}
+
+static void stim_event_signal(int fd) {
+    uint64_t value = 1;
+    ssize_t n;
+    n = write(fd, &value, sizeof(value));
+    (void)n;
+}
+
+static void stim_event_clear(int fd) {
+    uint64_t value;
+    ssize_t n;
+    n = read(fd, &value, sizeof(value));
+    (void)n;
+}
+#endif
+
+#if defined(STIM_BATCH_CB)
+/* Link a timer into a pending batch, folding repeated expirations */
+static void stim_batch_add(stim_t ***tail, stim_t *timer, stim_tick_t ticks) {
+    if (timer->batched) {
+        timer->expirations += (uint32_t)ticks;
+    } else {
+        timer->expirations = (uint32_t)ticks;
+        timer->batched = 1;
+        timer->batch_next = NULL;
+        **tail = timer;
+        *tail = &timer->batch_next;
+    }
+}
+
+/*
+ * Hand the linked timers to their batch callbacks, one call per callback
+ * and up to STIM_BATCH_SIZE timers, keeping the expiry order in each call.
+ */
+static void stim_batch_flush(stim_t *head) {
+    stim_t *batch[STIM_BATCH_SIZE];
+    stim_t **link;
+    stim_batch_cb_t batch_cb;
+    size_t num;
+    while (head) {
+        batch_cb = head->batch_cb;
+        num = 0;
+        link = &head;
+        while (*link && num < STIM_BATCH_SIZE) {
+            if ((*link)->batch_cb == batch_cb) {
+                batch[num] = *link;
+                batch[num++]->batched = 0;
+                *link = (*link)->batch_next;
+            } else {
+                link = &(*link)->batch_next;
+            }
+        }
+        batch_cb(batch, num);
+    }
+}
+#endif
+
+static int stim_post_event(stim_sched_t *sched, stim_t *timer,
+                           stim_tick_t periods) {
+    int ret = 0;
+    stim_message_t message;
+#if defined(STIM_COALESCE_EVENTS) && defined(STIM_LOCKFREE_QUEUE)
+    /*
+     * Dispatch takes the count with an exchange after receiving the event,
+     * so a zero count means no event of this timer is queued or in flight.
+     */
+    if (!atomic_fetch_add(&timer->pending, (uint32_t)periods)) {
+        message.timer = timer;
+        message.ticks = periods;
+        ret = stim_queue_send(&sched->expired_queue, &message);
+        if (ret) {
+            atomic_store(&timer->pending, 0);
+        }
+    }
+#elif defined(STIM_COALESCE_EVENTS)
+    int stim_lock_state;
+    uint32_t pending;
+    /* At most one queued event per timer, later expirations are folded */
+    stim_lock_state = stim_lock();
+    pending = timer->pending;
+    timer->pending += (uint32_t)periods;
+    stim_unlock(stim_lock_state);
+    if (!pending) {
+        message.timer = timer;
+        message.ticks = periods;
+        ret = stim_queue_send(&sched->expired_queue, &message);
+        if (ret) {
+            stim_lock_state = stim_lock();
+            timer->pending = 0;
+            stim_unlock(stim_lock_state);
+        }
+    }
+#else
+    message.timer = timer;
+    message.ticks = periods;
+    ret = stim_queue_send(&sched->expired_queue, &message);
+#endif
+    if (ret) {
+        STIM_STATS_ADD(sched, event_rejects, 1);
+    } else {
+        STIM_TRACE_EVENT_POST(sched, timer);
+    }
+    return ret;
+}
+
+int stim_sched_poll(stim_sched_t *sched) {
+    int stim_lock_state;
+    int ret = 0;
+    stim_t *timer;
+    stim_tick_t now;
+    stim_tick_t periods;
+#if defined(STIM_HISTOGRAM)
+    uint32_t begin;
+#endif
+#if defined(STIM_DISPATCH_WAIT)
+    int fd;
+    int posted = 0;
+#endif
+#if defined(STIM_BATCH_CB)
+    stim_t *batch = NULL;
+    stim_t **batch_tail = &batch;
+#endif
+    if (!sched) {
+        ret = -STIM_EINVAL;
+    } else {
+        now = stim_get_ticks(sched);
+        stim_process_commands(sched, now);
+        while ((timer = stim_list_pop(sched, now)) != NULL) {
+#if defined(STIM_LAZY_CANCEL)
+            if (stim_apply_cancel(sched, timer)) {
+                continue;
+            }
+#endif
+#if defined(STIM_LAZY_RESTART)
+            if (timer->deadline_ticks != timer->expire_ticks) {
+                /* Pushed out by a lazy restart, sort in at the real deadline */
+                timer->expire_ticks = timer->deadline_ticks;
+                stim_list_add(sched, timer, now);
+                continue;
+            }
+#endif
+            STIM_STATS_MAX(sched, max_lateness, now - timer->expire_ticks);
+#if defined(STIM_HISTOGRAM)
+            stim_histogram_add(sched->histogram.lateness,
+                               now - timer->expire_ticks);
+#endif
+            /* Account for every period missed since the last poll at once */
+            periods = 1;
+            if (timer->mode == STIM_MODE_PERIODIC &&
+                now - timer->expire_ticks >= timer->period_ticks) {
+                periods += (now - timer->expire_ticks) / timer->period_ticks;
+            }
+            STIM_TRACE_EXPIRE(sched, timer, periods);
+            stim_lock_state = stim_lock();
+            timer->count += (uint32_t)periods;
+            stim_unlock(stim_lock_state);
+            STIM_STATS_ADD(sched, expirations, (uint32_t)periods);
+            if (timer->mode == STIM_MODE_ONESHOT) {
+                timer->state = STIM_STATE_STOPPED;
+            } else {
+                timer->expire_ticks += periods * timer->period_ticks;
+#if defined(STIM_LAZY_RESTART)
+                timer->deadline_ticks = timer->expire_ticks;
+#endif
+                stim_list_add(sched, timer, now);
+            }
+#if defined(STIM_BATCH_CB)
+            if (timer->batch_cb &&
+                timer->cb_mode == STIM_CB_MODE_IMMEDIATE) {
+                /* Called back together with the rest of the pass */
+                stim_batch_add(&batch_tail, timer, periods);
+                continue;
+            }
+            if (timer->cb || timer->batch_cb) {
+#else
+            if (timer->cb) {
+#endif
+                if (timer->cb_mode == STIM_CB_MODE_IMMEDIATE) {
+                    timer->expirations = (uint32_t)periods;
+#if defined(STIM_HISTOGRAM)
+                    begin = STIM_CLOCK(sched);
+#endif
+                    STIM_TRACE_CALLBACK_BEGIN(sched, timer);
+                    timer->cb(timer, timer->user_data);
+                    STIM_TRACE_CALLBACK_END(sched, timer);
+#if defined(STIM_HISTOGRAM)
+                    stim_histogram_add(sched->histogram.immediate,
+                                       STIM_CLOCK(sched) - begin);
+#endif
+                } else {
+                    ret |= stim_post_event(sched, timer, periods);
+#if defined(STIM_DISPATCH_WAIT)
+                    posted = 1;
+#endif
+                }
+            }
+        }
+#if defined(STIM_BATCH_CB)
+        stim_batch_flush(batch);
+#endif
+#if defined(STIM_DISPATCH_WAIT)
+        /* One wakeup per poll pass covers every event it queued */
+        if (posted) {
+            fd = stim_event_fd(sched);
+            if (fd >= 0) {
+                stim_event_signal(fd);
+            }
+        }
+#endif
+    }
+    return ret;
+}
+
+int stim_poll(void) {
+    return stim_sched_poll(&stim_default_sched);
+}
+
+#if defined(STIM_POLL_WAIT)
+int stim_sched_poll_wait(stim_sched_t *sched, int timeout_ms) {
+    int ret = 0;
+    uint64_t value;
+    uint64_t deadline;
+    ssize_t n;
+    stim_tick_t ticks;
+    struct itimerspec spec;
+    struct epoll_event event;
+    if (!sched) {
+        ret = -STIM_EINVAL;
+    } else if (stim_poll_setup(sched) < 0) {
+        ret = -STIM_EIO;
+    } else {
+        /* Clear before polling so commands posted later wake the wait */
+        n = read(sched->timer_fd, &value, sizeof(value));
+        n = read(sched->command_fd, &value, sizeof(value));
+        (void)n;
+        stim_clock_sync(sched);
+        ret = stim_sched_poll(sched);
+        /*
+         * Wake up at least every 2^30 ticks even when idle, so a single
+         * sync never advances far enough to be mistaken for the past.
+         */
+        if (stim_sched_next_expiry(sched, &ticks) || ticks > 0x3FFFFFFF) {
+            ticks = 0x3FFFFFFF;
+        }
+        deadline = sched->clock_ns + (uint64_t)ticks * STIM_TICK_NS;
+        memset(&spec, 0, sizeof(spec));
+        spec.it_value.tv_sec = (time_t)(deadline / 1000000000u);
+        spec.it_value.tv_nsec = (long)(deadline % 1000000000u);
+        if (timerfd_settime(sched->timer_fd, TFD_TIMER_ABSTIME, &spec,
+                            NULL) < 0) {
+            ret = -STIM_EIO;
+        } else if (epoll_wait(sched->poll_fd, &event, 1, timeout_ms) < 0 &&
+                   errno != EINTR) {
+            /* A signal only ends the sleep early */
+            ret = -STIM_EIO;
+        }
+    }
+    return ret;
+}
+
+int stim_poll_wait(int timeout_ms) {
+    return stim_sched_poll_wait(&stim_default_sched, timeout_ms);
+}
+
+int stim_sched_poll_fd(stim_sched_t *sched) {
+    int ret;
+    if (!sched) {
+        ret = -STIM_EINVAL;
+    } else {
+        ret = stim_poll_setup(sched);
+        if (ret < 0) {
+            ret = -STIM_EIO;
+        }
+    }
+    return ret;
+}
+
+int stim_poll_fd(void) {
+    return stim_sched_poll_fd(&stim_default_sched);
+}
+#endif
+
+int stim_sched_next_expiry(stim_sched_t *sched, stim_tick_t *ticks) {
+    int ret = 0;
+    stim_tick_t now;
+    stim_tick_t expire;
+    if (!sched || !ticks) {
+        ret = -STIM_EINVAL;
+    } else {
+        now = stim_get_ticks(sched);
+        /* Apply queued starts and stops so they are part of the answer */
+        stim_process_commands(sched, now);
+        if (!stim_list_first(sched, &expire)) {
+            ret = -STIM_ENOENT;
+        } else if ((stim_diff_t)(expire - now) <= 0) {
+            *ticks = 0;
+        } else {
+            *ticks = expire - now;
+        }
+    }
+    return ret;
+}
+
+int stim_next_expiry(stim_tick_t *ticks) {
+    return stim_sched_next_expiry(&stim_default_sched, ticks);
+}
+
+/*
+ * Run the deferred callback of an event taken from the expired queue.
+ * Timers with a batch callback are linked at batch_tail when it is given,
+ * otherwise called back on their own.
+ */
+static void stim_run_event(stim_sched_t *sched, stim_message_t *message,
+                           stim_t ***batch_tail) {
+#if defined(STIM_HISTOGRAM)
+    uint32_t elapsed;
+#endif
+#if (defined(STIM_COALESCE_EVENTS) && !defined(STIM_LOCKFREE_QUEUE)) ||       \
+    (defined(STIM_HISTOGRAM) && defined(STIM_DISPATCH_WORKERS))
+    int stim_lock_state;
+#endif
+    (void)sched;
+    (void)batch_tail;
+#if defined(STIM_COALESCE_EVENTS) && defined(STIM_LOCKFREE_QUEUE)
+    message->ticks = atomic_exchange(&message->timer->pending, 0);
+#elif defined(STIM_COALESCE_EVENTS)
+    stim_lock_state = stim_lock();
+    message->ticks = message->timer->pending;
+    message->timer->pending = 0;
+    stim_unlock(stim_lock_state);
+#endif
+    STIM_TRACE_EVENT_TAKE(sched, message->timer);
+#if defined(STIM_BATCH_CB)
+    if (message->timer->batch_cb) {
+        if (batch_tail) {
+            stim_batch_add(batch_tail, message->timer, message->ticks);
+        } else {
+            message->timer->expirations = (uint32_t)message->ticks;
+            message->timer->batch_cb(&message->timer, 1);
+        }
+    } else if (message->timer->cb) {
+#else
+    if (message->timer->cb) {
+#endif
+        message->timer->expirations = (uint32_t)message->ticks;
+#if defined(STIM_HISTOGRAM)
+        elapsed = STIM_CLOCK(sched);
+#endif
+        STIM_TRACE_CALLBACK_BEGIN(sched, message->timer);
+        message->timer->cb(message->timer, message->timer->user_data);
+        STIM_TRACE_CALLBACK_END(sched, message->timer);
+#if defined(STIM_HISTOGRAM)
+        elapsed = STIM_CLOCK(sched) - elapsed;
+#if defined(STIM_DISPATCH_WORKERS)
+        stim_lock_state = stim_lock();
+#endif
+        stim_histogram_add(sched->histogram.deferred, elapsed);
+#if defined(STIM_DISPATCH_WORKERS)
+        stim_unlock(stim_lock_state);
+#endif
+#endif
+    }
+}
+
+#if defined(STIM_DISPATCH_WORKERS)
+static unsigned int stim_dispatch_events(stim_sched_t *sched,
+                                         uint8_t max_event_num) {
+    unsigned int num = 0;
+    stim_message_t message;
+#if defined(STIM_STATS) || defined(STIM_DISPATCH_SERIALIZE)
+    int stim_lock_state;
+#endif
+#if defined(STIM_DISPATCH_SERIALIZE)
+    uint8_t busy;
+#endif
+#if defined(STIM_STATS)
+    stim_lock_state = stim_lock();
+    STIM_STATS_MAX(sched, event_peak, stim_queue_depth(&sched->expired_queue));
+    stim_unlock(stim_lock_state);
+#endif
+    while (max_event_num-- &&
+           !stim_queue_receive(&sched->expired_queue, &message)) {
+        ++num;
+#if defined(STIM_DISPATCH_SERIALIZE)
+        /*
+         * An event for a timer whose callback runs on another worker is
+         * left to that worker, which calls back once more for it.
+         */
+        stim_lock_state = stim_lock();
+        busy = message.timer->busy;
+        if (busy) {
+            message.timer->backlog += message.ticks;
+        } else {
+            message.timer->busy = 1;
+        }
+        stim_unlock(stim_lock_state);
+        if (!busy) {
+            do {
+                stim_run_event(sched, &message, NULL);
+                stim_lock_state = stim_lock();
+                message.ticks = message.timer->backlog;
+                message.timer->backlog = 0;
+                message.timer->busy = message.ticks != 0;
+                stim_unlock(stim_lock_state);
+            } while (message.ticks);
+        }
+#else
+        stim_run_event(sched, &message, NULL);
+#endif
+    }
+    return num;
+}
+
+void stim_sched_dispatch_worker(stim_sched_t *sched, uint8_t max_event_num) {
+    stim_dispatch_events(sched, max_event_num);
+}
+
+void stim_dispatch_worker(uint8_t max_event_num) {
+    stim_sched_dispatch_worker(&stim_default_sched, max_event_num);
+}
+#else
+static unsigned int stim_dispatch_events(stim_sched_t *sched,
+                                         uint8_t max_event_num) {
+    unsigned int num = 0;
+    stim_message_t message;
+#if defined(STIM_BATCH_CB)
+    stim_t *batch = NULL;
+    stim_t **batch_tail = &batch;
+#endif
+    STIM_STATS_MAX(sched, event_peak, stim_queue_depth(&sched->expired_queue));
+    while (max_event_num-- &&
+           !stim_queue_receive(&sched->expired_queue, &message)) {
+        ++num;
+#if defined(STIM_BATCH_CB)
+        stim_run_event(sched, &message, &batch_tail);
+#else
+        stim_run_event(sched, &message, NULL);
+#endif
+    }
+#if defined(STIM_BATCH_CB)
+    stim_batch_flush(batch);
+#endif
+    return num;
+}
+#endif
+
+void stim_sched_dispatch(stim_sched_t *sched, uint8_t max_event_num) {
+    stim_dispatch_events(sched, max_event_num);
+}
+
+void stim_dispatch(uint8_t max_event_num) {
+    stim_sched_dispatch(&stim_default_sched, max_event_num);
+}
+
+#if defined(STIM_DISPATCH_WAIT)
+int stim_sched_dispatch_wait(stim_sched_t *sched, uint8_t max_event_num,
+                             int timeout_ms) {
+    int ret = 0;
+    int fd = -1;
+    unsigned int num;
+    struct pollfd pfd;
+    if (!sched) {
+        ret = -STIM_EINVAL;
+    } else {
+        fd = stim_event_fd(sched);
+        if (fd < 0) {
+            ret = -STIM_EIO;
+        }
+    }
+    if (!ret) {
+        /* Clear before looking at the queue so a later poll is not missed */
+        stim_event_clear(fd);
+        num = stim_dispatch_events(sched, max_event_num);
+        if (!num) {
+            pfd.fd = fd;
+            pfd.events = POLLIN;
+            pfd.revents = 0;
+            if (poll(&pfd, 1, timeout_ms) > 0) {
+                stim_event_clear(fd);
+                num = stim_dispatch_events(sched, max_event_num);
+            }
+        }
+        if (!num) {
+            ret = -STIM_EAGAIN;
+        } else if (num == max_event_num) {
+            /* More events may be queued, keep the next call from blocking */
+            stim_event_signal(fd);
+        }
+    }
+    return ret;
+}
+
+int stim_dispatch_wait(uint8_t max_event_num, int timeout_ms) {
+    return stim_sched_dispatch_wait(&stim_default_sched, max_event_num,
+                                    timeout_ms);
+}
+
+int stim_sched_dispatch_fd(stim_sched_t *sched) {
+    int ret;
+    if (!sched) {
+        ret = -STIM_EINVAL;
+    } else {
+        ret = stim_event_fd(sched);
+        if (ret < 0) {
+            ret = -STIM_EIO;
+        }
+    }
+    return ret;
+}
+
+int stim_dispatch_fd(void) {
+    return stim_sched_dispatch_fd(&stim_default_sched);
+}
+#endif
+
+#if defined(STIM_STATS)
+int stim_sched_get_stats(stim_sched_t *sched, stim_stats_t *stats) {
+    int stim_lock_state;
+    int ret = 0;
+    if (!sched || !stats) {
+        ret = -STIM_EINVAL;
+    } else {
+        stim_lock_state = stim_lock();
+        *stats = sched->stats;
+        stim_unlock(stim_lock_state);
+#if defined(STIM_LOCKFREE_QUEUE)
+        stats->command_rejects = atomic_load(&sched->command_rejects);
+#endif
+    }
+    return ret;
+}
+
+int stim_get_stats(stim_stats_t *stats) {
+    return stim_sched_get_stats(&stim_default_sched, stats);
+}
+#endif
+
+#if defined(STIM_HISTOGRAM)
+int stim_sched_get_histogram(stim_sched_t *sched,
+                             stim_histogram_t *histogram) {
+    int stim_lock_state;
+    int ret = 0;
+    if (!sched || !histogram) {
+        ret = -STIM_EINVAL;
+    } else {
+        stim_lock_state = stim_lock();
+        *histogram = sched->histogram;
+        stim_unlock(stim_lock_state);
+    }
+    return ret;
+}
+
+int stim_get_histogram(stim_histogram_t *histogram) {
+    return stim_sched_get_histogram(&stim_default_sched, histogram);
+}
+#endif
+
+int stim_set_mode(stim_t *timer, stim_mode_t mode) {
+    int stim_lock_state;
+    int ret = 0;
+    if (!timer ||
+        (mode != STIM_MODE_PERIODIC && mode != STIM_MODE_ONESHOT)) {
+        ret = -STIM_EINVAL;
+    } else {
+        stim_lock_state = stim_lock();
+        timer->mode = mode;
+        stim_unlock(stim_lock_state);
+    }
+    return ret;
+}
+
+#if defined(STIM_BATCH_CB)
+int stim_set_batch_cb(stim_t *timer, stim_batch_cb_t batch_cb) {
+    int stim_lock_state;
+    int ret = 0;
+    if (!timer) {
+        ret = -STIM_EINVAL;
+    } else {
+        stim_lock_state = stim_lock();
+        timer->batch_cb = batch_cb;
+        stim_unlock(stim_lock_state);
+    }
+    return ret;
+}
+#endif
+
+int stim_set_count(stim_t *timer, uint32_t count) {
+    int stim_lock_state;
+    int ret = 0;
+    if (!timer) {
+        ret = -STIM_EINVAL;
+    } else {
+        stim_lock_state = stim_lock();
+        timer->count = count;
+        stim_unlock(stim_lock_state);
+    }
+    return ret;
+}
+
+int stim_get_expirations(const stim_t *timer, uint32_t *expirations) {
+    int ret = 0;
+    if (!timer || !expirations) {
+        ret = -STIM_EINVAL;
+    } else {
+        *expirations = timer->expirations;
     }
     return ret;
 }
@@ -8,8 +8,13 @@
 extern "C" {
 #endif
 
+#include <stddef.h>
 #include <stdint.h>
 
+/* #define STIM_LOCK_HEADER "port_lock.h" */
+#if defined(STIM_LOCK_HEADER)
+#include STIM_LOCK_HEADER
+#else
 static inline int stim_lock(void) {
     /* Disable interrupts if needed */
     return 0;
@@ -19,22 +24,129 @@ static inline void stim_unlock(int stim_lock_state) {
     /* Restore interrupt state */
     (void)stim_lock_state;
 }
+#endif
 
 #define STIM_ATOMIC_TICKS
+/* #define STIM_TICKS_64 */
+/* #define STIM_SCHED_WHEEL */
+/* #define STIM_SCHED_HEAP */
+#if defined(STIM_SCHED_WHEEL) && defined(STIM_SCHED_HEAP)
+#error "STIM_SCHED_WHEEL and STIM_SCHED_HEAP are mutually exclusive"
+#endif
+/* #define STIM_LOCKFREE_QUEUE */
+/* #define STIM_COALESCE_EVENTS */
+/* #define STIM_DISPATCH_WORKERS */
+/* #define STIM_DISPATCH_SERIALIZE */
+#if defined(STIM_DISPATCH_SERIALIZE) && !defined(STIM_DISPATCH_WORKERS)
+#error "STIM_DISPATCH_SERIALIZE requires STIM_DISPATCH_WORKERS"
+#endif
+/* #define STIM_DISPATCH_WAIT */
+#if defined(STIM_DISPATCH_WAIT) && !defined(__linux__)
+#error "STIM_DISPATCH_WAIT requires Linux eventfd"
+#endif
+/* #define STIM_POLL_WAIT */
+#if defined(STIM_POLL_WAIT) && !defined(__linux__)
+#error "STIM_POLL_WAIT requires Linux timerfd and epoll"
+#endif
+/* #define STIM_MONOTONIC_TICKS */
+#if defined(STIM_MONOTONIC_TICKS) && !defined(STIM_TICK_CLOCK) &&              \
+    !defined(__unix__) && !defined(__APPLE__)
+#error "STIM_MONOTONIC_TICKS requires STIM_TICK_CLOCK() on this platform"
+#endif
+#if defined(STIM_POLL_WAIT) && defined(STIM_TICK_CLOCK)
+#error "STIM_POLL_WAIT only supports the built-in CLOCK_MONOTONIC ticks"
+#endif
+#if (defined(STIM_POLL_WAIT) || defined(STIM_MONOTONIC_TICKS)) &&              \
+    !defined(STIM_TICK_NS)
+#define STIM_TICK_NS 1000000
+#endif
+/* #define STIM_BATCH_CB */
+#if defined(STIM_BATCH_CB) && !defined(STIM_BATCH_SIZE)
+#define STIM_BATCH_SIZE 32
+#endif
+/* #define STIM_LAZY_RESTART */
+/* #define STIM_LAZY_CANCEL */
+/* #define STIM_STATS */
+/* #define STIM_HISTOGRAM */
+#if !defined(STIM_QUEUE_SIZE)
 #define STIM_QUEUE_SIZE (16)
-#if (STIM_QUEUE_SIZE > 256)
-#error "STIM_QUEUE_SIZE must be <= 256"
 #endif
 #if (STIM_QUEUE_SIZE & (STIM_QUEUE_SIZE - 1)) != 0
 #error "STIM_QUEUE_SIZE must be power of 2"
 #endif
-#define STIM_MAX_TICKS (((uint32_t)(-1)) >> 1)
+#if defined(STIM_LOCKFREE_QUEUE)
+#define STIM_QUEUE_CAPACITY STIM_QUEUE_SIZE
+#else
+/* One slot stays free to tell a full ring from an empty one */
+#define STIM_QUEUE_CAPACITY (STIM_QUEUE_SIZE - 1)
+#endif
+#if (STIM_QUEUE_SIZE <= 256)
+typedef uint8_t stim_index_t;
+#elif (STIM_QUEUE_SIZE <= 65536)
+typedef uint16_t stim_index_t;
+#else
+typedef uint32_t stim_index_t;
+#endif
+#if defined(STIM_LOCKFREE_QUEUE)
+#if !defined(__STDC_VERSION__) || __STDC_VERSION__ < 201112L ||                \
+    defined(__STDC_NO_ATOMICS__)
+#error "STIM_LOCKFREE_QUEUE requires C11 <stdatomic.h>"
+#endif
+#include <stdatomic.h>
+#endif
+#if defined(STIM_TICKS_64)
+typedef uint64_t stim_tick_t;
+typedef int64_t stim_diff_t;
+#else
+typedef uint32_t stim_tick_t;
+typedef int32_t stim_diff_t;
+#endif
+#define STIM_MAX_TICKS (((stim_tick_t)(-1)) >> 1)
 #define STIM_EINVAL 22
 #define STIM_EAGAIN 11
+#define STIM_ENOENT 2
+#define STIM_EIO 5
+
+/*
+ * Tracing hooks called by softimer.c on its hot paths. Define them here,
+ * for example to USDT probes or a trace ring, they expand to nothing
+ * otherwise.
+ */
+#ifndef STIM_TRACE_COMMAND_POST
+#define STIM_TRACE_COMMAND_POST(sched, timer, command) ((void)0)
+#endif
+#ifndef STIM_TRACE_COMMAND_TAKE
+#define STIM_TRACE_COMMAND_TAKE(sched, timer, command) ((void)0)
+#endif
+#ifndef STIM_TRACE_INSERT
+#define STIM_TRACE_INSERT(sched, timer) ((void)0)
+#endif
+#ifndef STIM_TRACE_REMOVE
+#define STIM_TRACE_REMOVE(sched, timer) ((void)0)
+#endif
+#ifndef STIM_TRACE_EXPIRE
+#define STIM_TRACE_EXPIRE(sched, timer, periods) ((void)0)
+#endif
+#ifndef STIM_TRACE_EVENT_POST
+#define STIM_TRACE_EVENT_POST(sched, timer) ((void)0)
+#endif
+#ifndef STIM_TRACE_EVENT_TAKE
+#define STIM_TRACE_EVENT_TAKE(sched, timer) ((void)0)
+#endif
+#ifndef STIM_TRACE_CALLBACK_BEGIN
+#define STIM_TRACE_CALLBACK_BEGIN(sched, timer) ((void)0)
+#endif
+#ifndef STIM_TRACE_CALLBACK_END
+#define STIM_TRACE_CALLBACK_END(sched, timer) ((void)0)
+#endif
 
 typedef struct stim stim_t;
+typedef struct stim_sched stim_sched_t;
 
 typedef void (*stim_cb_t)(stim_t *timer, void *user_data);
+#if defined(STIM_BATCH_CB)
+typedef void (*stim_batch_cb_t)(stim_t **timers, size_t num);
+#endif
 
 typedef enum {
     STIM_STATE_STOPPED = 0,
@@ -46,31 +158,262 @@ typedef enum {
     STIM_CB_MODE_IMMEDIATE,
 } stim_cb_mode_t;
 
+typedef enum {
+    STIM_MODE_PERIODIC = 0,
+    STIM_MODE_ONESHOT,
+} stim_mode_t;
+
 typedef struct stim_node {
     struct stim_node *next;
     struct stim_node *prev;
+#if defined(STIM_SCHED_HEAP)
+    struct stim_node *child;
+#endif
 } stim_node_t;
 
 struct stim {
     stim_node_t node;
+    stim_sched_t *sched;
     stim_cb_t cb;
     void *user_data;
     stim_cb_mode_t cb_mode;
+    stim_mode_t mode;
     stim_state_t state;
-    uint32_t expire_ticks;
-    uint32_t period_ticks;
+    stim_tick_t expire_ticks;
+#if defined(STIM_LAZY_RESTART)
+    stim_tick_t deadline_ticks;
+#endif
+    stim_tick_t period_ticks;
+#if defined(STIM_LOCKFREE_QUEUE)
+    atomic_uchar command;
+    _Atomic stim_tick_t command_ticks;
+#else
+    volatile uint8_t command;
+    stim_tick_t command_ticks;
+#endif
+#if defined(STIM_LAZY_CANCEL) && defined(STIM_LOCKFREE_QUEUE)
+    atomic_uchar cancelled;
+#elif defined(STIM_LAZY_CANCEL)
+    volatile uint8_t cancelled;
+#endif
     volatile uint32_t count;
+    uint32_t expirations;
+#if defined(STIM_COALESCE_EVENTS) && defined(STIM_LOCKFREE_QUEUE)
+    _Atomic uint32_t pending;
+#elif defined(STIM_COALESCE_EVENTS)
+    volatile uint32_t pending;
+#endif
+#if defined(STIM_DISPATCH_SERIALIZE)
+    volatile uint8_t busy;
+    stim_tick_t backlog;
+#endif
+#if defined(STIM_BATCH_CB)
+    stim_batch_cb_t batch_cb;
+    stim_t *batch_next;
+    uint8_t batched;
+#endif
 };
 
+/*
+ * Pending command bits of a timer. A stop clears a pending start, a start
+ * is added to a pending stop, so STOP | START restarts the timer.
+ */
+typedef enum {
+    STIM_COMMAND_STOP = 1,
+    STIM_COMMAND_START = 2,
+    STIM_COMMAND_RESTART = STIM_COMMAND_STOP | STIM_COMMAND_START,
+} stim_command_t;
+
+typedef struct {
+    stim_t *timer;
+    stim_tick_t ticks;
+} stim_message_t;
+
+#if defined(STIM_LOCKFREE_QUEUE)
+typedef struct {
+    atomic_uint sequence;
+    stim_message_t message;
+} stim_slot_t;
+
+typedef struct {
+    stim_slot_t buffer[STIM_QUEUE_SIZE];
+    atomic_uint write_index;
+#if defined(STIM_DISPATCH_WORKERS)
+    atomic_uint read_index;
+#else
+    unsigned int read_index;
+#endif
+} stim_queue_t;
+#else
+typedef struct {
+    stim_message_t buffer[STIM_QUEUE_SIZE];
+    volatile stim_index_t write_index;
+    volatile stim_index_t read_index;
+} stim_queue_t;
+#endif
+
+#if defined(STIM_SCHED_WHEEL)
+#define STIM_WHEEL_ROOT_BITS 8
+#define STIM_WHEEL_LEVEL_BITS 6
+#if defined(STIM_TICKS_64)
+#define STIM_WHEEL_LEVELS 10
+#else
+#define STIM_WHEEL_LEVELS 4
+#endif
+#define STIM_WHEEL_ROOT_SIZE (1 << STIM_WHEEL_ROOT_BITS)
+#define STIM_WHEEL_LEVEL_SIZE (1 << STIM_WHEEL_LEVEL_BITS)
+
+typedef struct {
+    stim_node_t root[STIM_WHEEL_ROOT_SIZE];
+    stim_node_t level[STIM_WHEEL_LEVELS][STIM_WHEEL_LEVEL_SIZE];
+    stim_node_t ready;
+    uint32_t root_map[STIM_WHEEL_ROOT_SIZE / 32];
+    uint32_t level_map[STIM_WHEEL_LEVELS][STIM_WHEEL_LEVEL_SIZE / 32];
+    stim_tick_t ticks;
+    uint32_t count;
+} stim_wheel_t;
+#endif
+
+#if defined(STIM_STATS)
+typedef struct {
+    uint32_t commands;         /* Command queue entries processed */
+    uint32_t command_rejects;  /* Commands rejected with a full queue */
+    uint32_t event_rejects;    /* Deferred events lost to a full queue */
+    uint32_t expirations;      /* Periods expired, caught up ones included */
+    stim_tick_t max_lateness;  /* Largest now - expire_ticks at expiry */
+    uint32_t command_peak;     /* Deepest command queue seen by the poll */
+    uint32_t event_peak;       /* Deepest event queue seen by dispatch */
+    uint32_t list_adds;        /* Sorted inserts into the ordered list */
+    uint32_t list_walk_total;  /* Nodes passed by those inserts */
+    uint32_t list_walk_max;    /* Longest single insert walk */
+} stim_stats_t;
+#endif
+
+#if defined(STIM_HISTOGRAM)
+#define STIM_HISTOGRAM_BUCKETS 32
+
+/*
+ * Bucket 0 counts zero, bucket i counts values in [2^(i-1), 2^i) and the
+ * last bucket everything above. Callback durations are measured with
+ * STIM_HISTOGRAM_CLOCK() when it is defined, in ticks otherwise.
+ */
+typedef struct {
+    uint32_t lateness[STIM_HISTOGRAM_BUCKETS];
+    uint32_t immediate[STIM_HISTOGRAM_BUCKETS];
+    uint32_t deferred[STIM_HISTOGRAM_BUCKETS];
+} stim_histogram_t;
+#endif
+
+/* Scheduler context, the members are private to softimer.c */
+struct stim_sched {
+#if defined(STIM_SCHED_WHEEL)
+    stim_wheel_t wheel;
+#elif defined(STIM_SCHED_HEAP)
+    stim_node_t *heap;
+    stim_tick_t heap_now;
+#else
+    stim_node_t list;
+    stim_node_t *batch;
+#endif
+    volatile stim_tick_t ticks;
+    stim_queue_t command_queue;
+    stim_queue_t expired_queue;
+#if defined(STIM_DISPATCH_WAIT) && defined(STIM_LOCKFREE_QUEUE)
+    atomic_int event_fd;
+#elif defined(STIM_DISPATCH_WAIT)
+    volatile int event_fd;
+#endif
+#if defined(STIM_POLL_WAIT) && defined(STIM_LOCKFREE_QUEUE)
+    atomic_int poll_fd;
+#elif defined(STIM_POLL_WAIT)
+    volatile int poll_fd;
+#endif
+#if defined(STIM_POLL_WAIT)
+    volatile int command_fd;
+    int timer_fd;
+    uint64_t clock_ns;
+#endif
+#if defined(STIM_STATS)
+    stim_stats_t stats;
+#endif
+#if defined(STIM_STATS) && defined(STIM_LOCKFREE_QUEUE)
+    /* Bumped by concurrent producers, merged into stats when read */
+    _Atomic uint32_t command_rejects;
+#endif
+#if defined(STIM_HISTOGRAM)
+    stim_histogram_t histogram;
+#endif
+};
+
+int stim_sched_init(stim_sched_t *sched);
+int stim_sched_deinit(stim_sched_t *sched);
+void stim_sched_tick_inc(stim_sched_t *sched);
+void stim_sched_tick_advance(stim_sched_t *sched, stim_tick_t ticks);
+int stim_sched_timer_init(stim_sched_t *sched, stim_t *timer,
+                          stim_tick_t period_ticks, stim_cb_mode_t cb_mode,
+                          stim_cb_t cb, void *user_data);
+int stim_sched_poll(stim_sched_t *sched);
+#if defined(STIM_POLL_WAIT)
+int stim_sched_poll_wait(stim_sched_t *sched, int timeout_ms);
+int stim_sched_poll_fd(stim_sched_t *sched);
+#endif
+int stim_sched_next_expiry(stim_sched_t *sched, stim_tick_t *ticks);
+void stim_sched_dispatch(stim_sched_t *sched, uint8_t max_event_num);
+#if defined(STIM_DISPATCH_WORKERS)
+void stim_sched_dispatch_worker(stim_sched_t *sched, uint8_t max_event_num);
+#endif
+#if defined(STIM_DISPATCH_WAIT)
+int stim_sched_dispatch_wait(stim_sched_t *sched, uint8_t max_event_num,
+                             int timeout_ms);
+int stim_sched_dispatch_fd(stim_sched_t *sched);
+#endif
+#if defined(STIM_STATS)
+int stim_sched_get_stats(stim_sched_t *sched, stim_stats_t *stats);
+#endif
+#if defined(STIM_HISTOGRAM)
+int stim_sched_get_histogram(stim_sched_t *sched,
+                             stim_histogram_t *histogram);
+#endif
+
 void stim_tick_inc(void);
-int stim_init(stim_t *timer, uint32_t period_ticks, stim_cb_mode_t cb_mode,
+void stim_tick_advance(stim_tick_t ticks);
+int stim_init(stim_t *timer, stim_tick_t period_ticks, stim_cb_mode_t cb_mode,
               stim_cb_t cb, void *user_data);
 int stim_start(stim_t *timer);
+int stim_start_after(stim_t *timer, stim_tick_t delay_ticks);
 int stim_stop(stim_t *timer);
+int stim_restart(stim_t *timer);
+int stim_start_many(stim_t *const *timers, size_t num);
+int stim_stop_many(stim_t *const *timers, size_t num);
+int stim_start_sync(stim_t *timer);
+int stim_stop_sync(stim_t *timer);
 int stim_poll(void);
+#if defined(STIM_POLL_WAIT)
+int stim_poll_wait(int timeout_ms);
+int stim_poll_fd(void);
+#endif
+int stim_next_expiry(stim_tick_t *ticks);
 void stim_dispatch(uint8_t max_event_num);
+#if defined(STIM_DISPATCH_WORKERS)
+void stim_dispatch_worker(uint8_t max_event_num);
+#endif
+#if defined(STIM_DISPATCH_WAIT)
+int stim_dispatch_wait(uint8_t max_event_num, int timeout_ms);
+int stim_dispatch_fd(void);
+#endif
+int stim_set_mode(stim_t *timer, stim_mode_t mode);
+#if defined(STIM_BATCH_CB)
+int stim_set_batch_cb(stim_t *timer, stim_batch_cb_t batch_cb);
+#endif
 int stim_set_count(stim_t *timer, uint32_t count);
 int stim_get_count(const stim_t *timer, uint32_t *count);
+int stim_get_expirations(const stim_t *timer, uint32_t *expirations);
+#if defined(STIM_STATS)
+int stim_get_stats(stim_stats_t *stats);
+#endif
+#if defined(STIM_HISTOGRAM)
+int stim_get_histogram(stim_histogram_t *histogram);
+#endif
 
 #ifdef __cplusplus
 }
@@ -0,0 +1,361 @@
+// SPDX-License-Identifier: MIT
+// Copyright (c) 2025 Zhijian Yan
+
+/*
+ * Host benchmark for softimer. Each build configuration from the Makefile
+ * runs the same cases, timed with CLOCK_MONOTONIC. Every sample covers a
+ * small group of operations, the columns give the mean cost of one
+ * operation over the whole run and its distribution across samples.
+ */
+
+#define _POSIX_C_SOURCE 200809L
+
+#include "softimer.h"
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#define BENCH_SAMPLES 20000
+#define BENCH_POLL_GROUP 16
+#define BENCH_BURST_ROUNDS 50
+#define BENCH_PRODUCER_MAX 8
+#define BENCH_PRODUCER_TIMERS 4
+#define BENCH_PRODUCER_OPS 200000
+#define BENCH_PRODUCER_GROUP 64
+
+typedef struct {
+    uint64_t *ns;
+    size_t count;
+    size_t capacity;
+    uint64_t total_ns;
+    uint64_t total_ops;
+} samples_t;
+
+static uint32_t rng_state = 0x2545F491u;
+
+static uint32_t rng(void) {
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 17;
+    rng_state ^= rng_state << 5;
+    return rng_state;
+}
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+static void *xcalloc(size_t num, size_t size) {
+    void *ptr = calloc(num, size);
+    if (!ptr) {
+        fprintf(stderr, "out of memory\n");
+        exit(1);
+    }
+    return ptr;
+}
+
+static void samples_init(samples_t *samples, size_t capacity) {
+    samples->ns = xcalloc(capacity, sizeof(uint64_t));
+    samples->count = 0;
+    samples->capacity = capacity;
+    samples->total_ns = 0;
+    samples->total_ops = 0;
+}
+
+/* Record a group of ops, the sample keeps the cost of one op */
+static void samples_add(samples_t *samples, uint64_t ns, uint64_t ops) {
+    samples->total_ns += ns;
+    samples->total_ops += ops;
+    if (samples->count < samples->capacity) {
+        samples->ns[samples->count++] = ns / ops;
+    }
+}
+
+static int compare_u64(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a;
+    uint64_t y = *(const uint64_t *)b;
+    return (x > y) - (x < y);
+}
+
+static void samples_report(samples_t *samples, const char *name,
+                           size_t timers) {
+    uint64_t p50 = 0;
+    uint64_t p99 = 0;
+    uint64_t max = 0;
+    if (samples->count) {
+        qsort(samples->ns, samples->count, sizeof(uint64_t), compare_u64);
+        p50 = samples->ns[samples->count / 2];
+        p99 = samples->ns[samples->count * 99 / 100];
+        max = samples->ns[samples->count - 1];
+    }
+    printf("%-12s %8zu %10.1f %8llu %8llu %10llu\n", name, timers,
+           samples->total_ops
+               ? (double)samples->total_ns / (double)samples->total_ops
+               : 0.0,
+           (unsigned long long)p50, (unsigned long long)p99,
+           (unsigned long long)max);
+    free(samples->ns);
+}
+
+static void counter_cb(stim_t *timer, void *user_data) {
+    (void)timer;
+    ++*(uint64_t *)user_data;
+}
+
+/*
+ * Start timers with descending deadlines, the ordered list then inserts
+ * every batch at its head and large populations build in linear time.
+ */
+static stim_t *populate(stim_sched_t *sched, size_t num, stim_tick_t base) {
+    stim_t *timers = xcalloc(num ? num : 1, sizeof(stim_t));
+    size_t i;
+    for (i = 0; i < num; ++i) {
+        stim_sched_timer_init(sched, &timers[i],
+                              base + (stim_tick_t)(rng() % base),
+                              STIM_CB_MODE_IMMEDIATE, NULL, NULL);
+        stim_start_after(&timers[i], base - (stim_tick_t)(i % base));
+        if ((i + 1) % STIM_QUEUE_CAPACITY == 0) {
+            stim_sched_poll(sched);
+        }
+    }
+    stim_sched_poll(sched);
+    return timers;
+}
+
+/* Start then stop a queue worth of timers, background timers stay armed */
+static void bench_start_stop(size_t background) {
+    static stim_sched_t sched;
+    stim_t group[STIM_QUEUE_CAPACITY];
+    stim_t *timers;
+    samples_t samples;
+    uint64_t begin;
+    size_t i;
+    size_t j;
+    stim_sched_init(&sched);
+    timers = populate(&sched, background, 1u << 20);
+    for (i = 0; i < STIM_QUEUE_CAPACITY; ++i) {
+        stim_sched_timer_init(&sched, &group[i], 1 + rng() % (1u << 21),
+                              STIM_CB_MODE_IMMEDIATE, NULL, NULL);
+    }
+    samples_init(&samples, BENCH_SAMPLES);
+    for (i = 0; i < BENCH_SAMPLES; ++i) {
+        begin = now_ns();
+        for (j = 0; j < STIM_QUEUE_CAPACITY; ++j) {
+            stim_start(&group[j]);
+        }
+        stim_sched_poll(&sched);
+        for (j = 0; j < STIM_QUEUE_CAPACITY; ++j) {
+            stim_stop(&group[j]);
+        }
+        stim_sched_poll(&sched);
+        samples_add(&samples, now_ns() - begin, 2 * STIM_QUEUE_CAPACITY);
+    }
+    samples_report(&samples, "start_stop", background);
+    free(timers);
+}
+
+/* Poll one tick at a time while no timer expires */
+static void bench_poll_idle(size_t num) {
+    static stim_sched_t sched;
+    stim_t *timers;
+    samples_t samples;
+    uint64_t begin;
+    size_t i;
+    size_t j;
+    stim_sched_init(&sched);
+    timers = populate(&sched, num, 1u << 22);
+    samples_init(&samples, BENCH_SAMPLES);
+    for (i = 0; i < BENCH_SAMPLES; ++i) {
+        begin = now_ns();
+        for (j = 0; j < BENCH_POLL_GROUP; ++j) {
+            stim_sched_tick_inc(&sched);
+            stim_sched_poll(&sched);
+        }
+        samples_add(&samples, now_ns() - begin, BENCH_POLL_GROUP);
+    }
+    samples_report(&samples, "poll_idle", num);
+    free(timers);
+}
+
+/* Periodic timers sharing one period all expire in a single poll */
+static void bench_expiry_burst(size_t num) {
+    static stim_sched_t sched;
+    stim_t *timers = xcalloc(num, sizeof(stim_t));
+    samples_t samples;
+    uint64_t fired = 0;
+    uint64_t begin;
+    size_t i;
+    stim_sched_init(&sched);
+    for (i = 0; i < num; ++i) {
+        stim_sched_timer_init(&sched, &timers[i], 1000,
+                              STIM_CB_MODE_IMMEDIATE, counter_cb, &fired);
+        stim_start(&timers[i]);
+        if ((i + 1) % STIM_QUEUE_CAPACITY == 0) {
+            stim_sched_poll(&sched);
+        }
+    }
+    stim_sched_poll(&sched);
+    samples_init(&samples, BENCH_BURST_ROUNDS);
+    for (i = 0; i < BENCH_BURST_ROUNDS; ++i) {
+        stim_sched_tick_advance(&sched, 999);
+        stim_sched_poll(&sched);
+        stim_sched_tick_inc(&sched);
+        begin = now_ns();
+        stim_sched_poll(&sched);
+        samples_add(&samples, now_ns() - begin, num);
+    }
+    if (fired != (uint64_t)num * BENCH_BURST_ROUNDS) {
+        fprintf(stderr, "expiry_burst: %llu of %llu callbacks\n",
+                (unsigned long long)fired,
+                (unsigned long long)num * BENCH_BURST_ROUNDS);
+    }
+    samples_report(&samples, "expiry_burst", num);
+    free(timers);
+}
+
+/* Run the deferred callbacks of a full event queue */
+static void bench_dispatch(void) {
+    static stim_sched_t sched;
+    stim_t timers[STIM_QUEUE_CAPACITY];
+    samples_t samples;
+    uint64_t fired = 0;
+    uint64_t begin;
+    size_t i;
+    stim_sched_init(&sched);
+    for (i = 0; i < STIM_QUEUE_CAPACITY; ++i) {
+        stim_sched_timer_init(&sched, &timers[i], 1, STIM_CB_MODE_DEFERRED,
+                              counter_cb, &fired);
+        stim_start(&timers[i]);
+    }
+    stim_sched_poll(&sched);
+    samples_init(&samples, BENCH_SAMPLES);
+    for (i = 0; i < BENCH_SAMPLES; ++i) {
+        stim_sched_tick_inc(&sched);
+        stim_sched_poll(&sched);
+        begin = now_ns();
+        stim_sched_dispatch(&sched, 255);
+        samples_add(&samples, now_ns() - begin, STIM_QUEUE_CAPACITY);
+    }
+    if (fired != (uint64_t)STIM_QUEUE_CAPACITY * BENCH_SAMPLES) {
+        fprintf(stderr, "dispatch: %llu of %llu callbacks\n",
+                (unsigned long long)fired,
+                (unsigned long long)STIM_QUEUE_CAPACITY * BENCH_SAMPLES);
+    }
+    samples_report(&samples, "dispatch", STIM_QUEUE_CAPACITY);
+}
+
+#if defined(STIM_LOCKFREE_QUEUE) || defined(STIM_LOCK_HEADER)
+typedef struct {
+    stim_t timers[BENCH_PRODUCER_TIMERS];
+    uint64_t ns[BENCH_PRODUCER_OPS / BENCH_PRODUCER_GROUP];
+} producer_t;
+
+static atomic_int contention_done;
+
+static void *contention_producer(void *arg) {
+    producer_t *producer = arg;
+    stim_t *timer;
+    uint64_t begin;
+    int i;
+    int j;
+    for (i = 0; i < BENCH_PRODUCER_OPS / BENCH_PRODUCER_GROUP; ++i) {
+        begin = now_ns();
+        for (j = 0; j < BENCH_PRODUCER_GROUP; ++j) {
+            timer = &producer->timers[j % BENCH_PRODUCER_TIMERS];
+            while (((j / BENCH_PRODUCER_TIMERS) & 1 ? stim_stop(timer)
+                                                     : stim_start(timer)) ==
+                   -STIM_EAGAIN) {
+                sched_yield();
+            }
+        }
+        producer->ns[i] = now_ns() - begin;
+    }
+    return NULL;
+}
+
+static void *contention_poller(void *arg) {
+    stim_sched_t *sched = arg;
+    while (!contention_done) {
+        stim_sched_tick_inc(sched);
+        stim_sched_poll(sched);
+    }
+    return NULL;
+}
+
+/* Producers post start and stop commands while one thread polls */
+static void bench_contention(int producers_num) {
+    static stim_sched_t sched;
+    static producer_t producers[BENCH_PRODUCER_MAX];
+    pthread_t threads[BENCH_PRODUCER_MAX];
+    pthread_t poller;
+    samples_t samples;
+    int i;
+    int j;
+    stim_sched_init(&sched);
+    for (i = 0; i < producers_num; ++i) {
+        for (j = 0; j < BENCH_PRODUCER_TIMERS; ++j) {
+            stim_sched_timer_init(&sched, &producers[i].timers[j],
+                                  1 + rng() % 1000, STIM_CB_MODE_IMMEDIATE,
+                                  NULL, NULL);
+        }
+    }
+    contention_done = 0;
+    pthread_create(&poller, NULL, contention_poller, &sched);
+    for (i = 0; i < producers_num; ++i) {
+        pthread_create(&threads[i], NULL, contention_producer, &producers[i]);
+    }
+    for (i = 0; i < producers_num; ++i) {
+        pthread_join(threads[i], NULL);
+    }
+    contention_done = 1;
+    pthread_join(poller, NULL);
+    samples_init(&samples, (size_t)producers_num * BENCH_PRODUCER_OPS /
+                               BENCH_PRODUCER_GROUP);
+    for (i = 0; i < producers_num; ++i) {
+        for (j = 0; j < BENCH_PRODUCER_OPS / BENCH_PRODUCER_GROUP; ++j) {
+            samples_add(&samples, producers[i].ns[j], BENCH_PRODUCER_GROUP);
+        }
+    }
+    /*
+     * Producers run side by side, so their mean time is the wall time for
+     * the commands of all threads. Samples stay per thread.
+     */
+    samples.total_ns /= (uint64_t)producers_num;
+    samples_report(&samples, "contention", (size_t)producers_num);
+}
+#endif
+
+int main(int argc, char **argv) {
+    size_t max_timers = 1000000;
+    size_t num;
+    int producers_num;
+    if (argc > 1) {
+        max_timers = (size_t)strtoul(argv[1], NULL, 0);
+    }
+    printf("%-12s %8s %10s %8s %8s %10s\n", "case", "timers", "ns/op", "p50",
+           "p99", "max");
+    for (num = 0; num <= max_timers && num <= 100000;
+         num = num ? num * 100 : 1000) {
+        bench_start_stop(num);
+    }
+    for (num = 10; num <= max_timers; num *= 10) {
+        bench_poll_idle(num);
+    }
+    for (num = 10; num <= max_timers && num <= 10000; num *= 10) {
+        bench_expiry_burst(num);
+    }
+    bench_dispatch();
+#if defined(STIM_LOCKFREE_QUEUE) || defined(STIM_LOCK_HEADER)
+    for (producers_num = 1; producers_num <= BENCH_PRODUCER_MAX;
+         producers_num *= 2) {
+        bench_contention(producers_num);
+    }
+#else
+    (void)producers_num;
+#endif
+    return 0;
+}
@@ -0,0 +1,25 @@
+// SPDX-License-Identifier: MIT
+// Copyright (c) 2025 Zhijian Yan
+
+#ifndef __TEST_LOCK_H
+#define __TEST_LOCK_H
+
+#include <pthread.h>
+
+/*
+ * Process-wide mutex standing in for the interrupt lock, included through
+ * STIM_LOCK_HEADER by the locked test configurations.
+ */
+static pthread_mutex_t stim_test_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static inline int stim_lock(void) {
+    pthread_mutex_lock(&stim_test_mutex);
+    return 0;
+}
+
+static inline void stim_unlock(int stim_lock_state) {
+    (void)stim_lock_state;
+    pthread_mutex_unlock(&stim_test_mutex);
+}
+
+#endif
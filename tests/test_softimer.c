@@ -0,0 +1,805 @@
+// SPDX-License-Identifier: MIT
+// Copyright (c) 2025 Zhijian Yan
+
+/*
+ * Host tests for softimer. Every build configuration from the Makefile runs
+ * the same cases, the randomized ones against a reference model of the
+ * ordered list scheduler, so the wheel and heap backends are held to the
+ * list behavior.
+ */
+
+#include "softimer.h"
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <string.h>
+
+#define TEST_TIMERS 12
+#define STRESS_PRODUCERS 8
+#define STRESS_TIMERS 4
+#define STRESS_ITERATIONS 200000
+#define DISPATCH_ITERATIONS 3000000
+
+static int failures;
+
+#define CHECK(cond)                                                            \
+    do {                                                                       \
+        if (!(cond)) {                                                         \
+            ++failures;                                                        \
+            fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__,   \
+                    #cond);                                                    \
+        }                                                                      \
+    } while (0)
+
+static uint32_t rng_state;
+
+static uint32_t rng(void) {
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 17;
+    rng_state ^= rng_state << 5;
+    return rng_state;
+}
+
+#if defined(STIM_TICKS_64)
+static stim_tick_t rng_ticks(stim_tick_t limit) {
+    stim_tick_t value = ((stim_tick_t)rng() << 32) | rng();
+    return value % limit;
+}
+#endif
+
+/* Move a fresh scheduler to start without ever jumping past STIM_MAX_TICKS */
+static void advance_to(stim_sched_t *sched, stim_tick_t start) {
+    stim_tick_t step;
+    while (start) {
+        step = start > STIM_MAX_TICKS ? STIM_MAX_TICKS : start;
+        stim_sched_tick_advance(sched, step);
+        stim_sched_poll(sched);
+        start -= step;
+    }
+}
+
+static uint32_t get_count(const stim_t *timer) {
+    uint32_t count = 0;
+    stim_get_count(timer, &count);
+    return count;
+}
+
+/* Reference model, mirrors what the ordered list does with each command */
+typedef struct {
+    stim_t timer;
+    int running;
+    stim_mode_t mode;
+    stim_tick_t period;
+    stim_tick_t expire;
+    uint8_t pending;
+    stim_tick_t pending_ticks;
+    uint32_t count;
+} ref_timer_t;
+
+static void ref_post(ref_timer_t *ref, uint8_t command, stim_tick_t ticks) {
+    if (command & STIM_COMMAND_STOP) {
+        ref->pending = command;
+    } else {
+        ref->pending |= command;
+    }
+    if (command & STIM_COMMAND_START) {
+        ref->pending_ticks = ticks;
+    }
+}
+
+static void ref_process(ref_timer_t *refs, int num, stim_tick_t now) {
+    int i;
+    ref_timer_t *ref;
+    for (i = 0; i < num; ++i) {
+        ref = &refs[i];
+        if (ref->pending == STIM_COMMAND_RESTART && ref->running) {
+            ref->expire =
+                (ref->pending_ticks ? ref->pending_ticks : ref->period) + now;
+        } else {
+            if (ref->pending & STIM_COMMAND_STOP) {
+                ref->running = 0;
+            }
+            if ((ref->pending & STIM_COMMAND_START) && !ref->running) {
+                ref->running = 1;
+                ref->expire =
+                    (ref->pending_ticks ? ref->pending_ticks : ref->period) +
+                    now;
+            }
+        }
+        ref->pending = 0;
+    }
+}
+
+static void ref_poll(ref_timer_t *refs, int num, stim_tick_t now) {
+    int i;
+    stim_tick_t periods;
+    ref_timer_t *ref;
+    ref_process(refs, num, now);
+    for (i = 0; i < num; ++i) {
+        ref = &refs[i];
+        if (!ref->running || (stim_diff_t)(ref->expire - now) > 0) {
+            continue;
+        }
+        periods = 1;
+        if (ref->mode == STIM_MODE_PERIODIC &&
+            now - ref->expire >= ref->period) {
+            periods += (now - ref->expire) / ref->period;
+        }
+        ref->count += (uint32_t)periods;
+        if (ref->mode == STIM_MODE_ONESHOT) {
+            ref->running = 0;
+        } else {
+            ref->expire += periods * ref->period;
+        }
+    }
+}
+
+static int ref_next_expiry(ref_timer_t *refs, int num, stim_tick_t now,
+                           stim_tick_t *ticks) {
+    int i;
+    int found = 0;
+    stim_diff_t diff;
+    for (i = 0; i < num; ++i) {
+        if (!refs[i].running) {
+            continue;
+        }
+        diff = (stim_diff_t)(refs[i].expire - now);
+        if (diff < 0) {
+            diff = 0;
+        }
+        if (!found || (stim_tick_t)diff < *ticks) {
+            *ticks = (stim_tick_t)diff;
+            found = 1;
+        }
+    }
+    return found;
+}
+
+/* Both sides apply their pending commands before answering */
+static int check_next_expiry(stim_sched_t *sched, ref_timer_t *refs,
+                             stim_tick_t now, stim_tick_t *ticks) {
+    int ret;
+    int found;
+    stim_tick_t ref_ticks = 0;
+    ret = stim_sched_next_expiry(sched, ticks);
+    ref_process(refs, TEST_TIMERS, now);
+    found = ref_next_expiry(refs, TEST_TIMERS, now, &ref_ticks);
+#if defined(STIM_LAZY_CANCEL) || defined(STIM_LAZY_RESTART)
+    /* Tombstones and stale positions may only report earlier deadlines */
+    CHECK(!found || (!ret && *ticks <= ref_ticks));
+#else
+    CHECK(found ? !ret && *ticks == ref_ticks : ret == -STIM_ENOENT);
+#endif
+    *ticks = ref_ticks;
+    return found;
+}
+
+static stim_tick_t rng_period(void) {
+    stim_tick_t period;
+    switch (rng() % 8) {
+    case 0:
+    case 1:
+    case 2:
+        period = 1 + rng() % 64;
+        break;
+    case 3:
+    case 4:
+        period = 1 + rng() % 4096;
+        break;
+    case 5:
+    case 6:
+        period = 1 + rng() % (1u << 21);
+        break;
+    default:
+#if defined(STIM_TICKS_64)
+        period = 1 + rng_ticks((stim_tick_t)1 << 40);
+#else
+        period = 1 + rng() % (1u << 28);
+#endif
+        break;
+    }
+    return period;
+}
+
+static void fuzz_run(uint32_t seed, stim_tick_t start, int steps) {
+    static stim_sched_t sched;
+    static ref_timer_t refs[TEST_TIMERS];
+    int i;
+    int step;
+    int ops;
+    int before = failures;
+    ref_timer_t *ref;
+    stim_tick_t now = start;
+    stim_tick_t delay;
+    stim_tick_t ticks;
+    rng_state = seed;
+    stim_sched_init(&sched);
+    advance_to(&sched, start);
+    memset(refs, 0, sizeof(refs));
+    for (i = 0; i < TEST_TIMERS; ++i) {
+        refs[i].period = rng_period();
+        stim_sched_timer_init(&sched, &refs[i].timer, refs[i].period,
+                              STIM_CB_MODE_IMMEDIATE, NULL, NULL);
+    }
+    for (step = 0; step < steps && failures == before; ++step) {
+        for (ops = rng() % 7; ops > 0; --ops) {
+            ref = &refs[rng() % TEST_TIMERS];
+            switch (rng() % 8) {
+            case 0:
+            case 1:
+                CHECK(!stim_start(&ref->timer));
+                ref_post(ref, STIM_COMMAND_START, 0);
+                break;
+            case 2:
+            case 3:
+                CHECK(!stim_stop(&ref->timer));
+                ref_post(ref, STIM_COMMAND_STOP, 0);
+                break;
+            case 4:
+                CHECK(!stim_restart(&ref->timer));
+                ref_post(ref, STIM_COMMAND_RESTART, 0);
+                break;
+            case 5:
+                delay = rng_period();
+                CHECK(!stim_start_after(&ref->timer, delay));
+                ref_post(ref, STIM_COMMAND_START, delay);
+                break;
+            case 6:
+                ref->mode = ref->mode == STIM_MODE_PERIODIC
+                                ? STIM_MODE_ONESHOT
+                                : STIM_MODE_PERIODIC;
+                CHECK(!stim_set_mode(&ref->timer, ref->mode));
+                break;
+            default:
+                check_next_expiry(&sched, refs, now, &ticks);
+                break;
+            }
+        }
+        switch (rng() % 16) {
+        case 10:
+        case 11:
+            ticks = rng() % 5000;
+            break;
+        case 12:
+        case 13:
+            ticks = rng() % (1u << 22);
+            break;
+        case 14:
+        case 15:
+            /* Land on, or just before, the next deadline like tickless idle */
+            if (!check_next_expiry(&sched, refs, now, &ticks)) {
+                ticks = 1;
+            } else if (ticks && (rng() & 1)) {
+                --ticks;
+            }
+            break;
+        default:
+            ticks = rng() % 4;
+            break;
+        }
+        stim_sched_tick_advance(&sched, ticks);
+        now += ticks;
+        CHECK(!stim_sched_poll(&sched));
+        ref_poll(refs, TEST_TIMERS, now);
+        for (i = 0; i < TEST_TIMERS; ++i) {
+            CHECK(get_count(&refs[i].timer) == refs[i].count);
+#if !defined(STIM_LAZY_CANCEL)
+            CHECK((refs[i].timer.state == STIM_STATE_RUNNING) ==
+                  refs[i].running);
+#endif
+        }
+    }
+    if (failures != before) {
+        fprintf(stderr, "fuzz seed %u start %llu failed at step %d\n", seed,
+                (unsigned long long)start, step - 1);
+    }
+}
+
+static void test_fuzz(void) {
+    static const uint32_t seeds[] = {1, 2, 3, 0x9E3779B9u, 0xDEADBEEFu};
+    static const stim_tick_t starts[] = {
+        0,
+        0x7FFFF000u,
+        0xFFFFF000u,
+#if defined(STIM_TICKS_64)
+        (stim_tick_t)-0x100000,
+#endif
+    };
+    size_t i;
+    size_t j;
+    for (i = 0; i < sizeof(seeds) / sizeof(seeds[0]); ++i) {
+        for (j = 0; j < sizeof(starts) / sizeof(starts[0]); ++j) {
+            fuzz_run(seeds[i], starts[j], 100000);
+        }
+    }
+}
+
+/*
+ * A level-1 slot that is due at the next root boundary must be cascaded even
+ * when a later level-0 slot is occupied as well.
+ */
+static void test_wheel_cascade(void) {
+    static stim_sched_t sched;
+    stim_t a;
+    stim_t b;
+    stim_tick_t ticks;
+    stim_sched_init(&sched);
+    stim_sched_timer_init(&sched, &a, 16484, STIM_CB_MODE_IMMEDIATE, NULL,
+                          NULL);
+    stim_sched_timer_init(&sched, &b, 852, STIM_CB_MODE_IMMEDIATE, NULL,
+                          NULL);
+    stim_start(&a);
+    stim_sched_poll(&sched);
+    stim_sched_tick_advance(&sched, 16300);
+    stim_sched_poll(&sched);
+    stim_start(&b);
+    stim_sched_poll(&sched);
+    CHECK(!stim_sched_next_expiry(&sched, &ticks) && ticks == 184);
+    stim_sched_tick_advance(&sched, 184);
+    stim_sched_poll(&sched);
+    CHECK(get_count(&a) == 1 && get_count(&b) == 0);
+    CHECK(!stim_sched_next_expiry(&sched, &ticks) && ticks == 668);
+}
+
+/*
+ * A stopped timer may still be linked with STIM_LAZY_CANCEL, after
+ * stim_stop_sync() its memory can be reused right away.
+ */
+static void test_stop_reuse(void) {
+    static stim_sched_t sched;
+    stim_t a;
+    stim_t b;
+    int i;
+    stim_sched_init(&sched);
+    stim_sched_timer_init(&sched, &a, 100, STIM_CB_MODE_IMMEDIATE, NULL,
+                          NULL);
+    stim_sched_timer_init(&sched, &b, 50, STIM_CB_MODE_IMMEDIATE, NULL,
+                          NULL);
+    stim_start(&a);
+    stim_start(&b);
+    stim_sched_poll(&sched);
+    stim_stop(&a);
+    stim_sched_poll(&sched);
+    CHECK(!stim_stop_sync(&a));
+    memset(&a, 0xA5, sizeof(a));
+    for (i = 0; i < 300; ++i) {
+        stim_sched_tick_inc(&sched);
+        stim_sched_poll(&sched);
+    }
+    CHECK(get_count(&b) == 6);
+    stim_sched_timer_init(&sched, &a, 100, STIM_CB_MODE_IMMEDIATE, NULL,
+                          NULL);
+    stim_start(&a);
+    stim_sched_poll(&sched);
+    stim_sched_tick_advance(&sched, 100);
+    stim_sched_poll(&sched);
+    CHECK(get_count(&a) == 1);
+}
+
+/* Nothing running, any idle jump is allowed before the next start */
+static void test_idle_jump(void) {
+    static stim_sched_t sched;
+    stim_t timer;
+    int i;
+    stim_sched_init(&sched);
+    stim_sched_timer_init(&sched, &timer, 10, STIM_CB_MODE_IMMEDIATE, NULL,
+                          NULL);
+    stim_set_mode(&timer, STIM_MODE_PERIODIC);
+    stim_sched_poll(&sched);
+    stim_sched_tick_advance(&sched, (stim_tick_t)0x90000000u);
+    stim_sched_poll(&sched);
+    stim_start(&timer);
+    stim_sched_poll(&sched);
+    for (i = 0; i < 100; ++i) {
+        stim_sched_tick_inc(&sched);
+        stim_sched_poll(&sched);
+    }
+    CHECK(get_count(&timer) == 10);
+}
+
+static stim_tick_t order_log[16];
+static int order_num;
+
+static void order_cb(stim_t *timer, void *user_data) {
+    (void)timer;
+    if (order_num < 16) {
+        order_log[order_num++] = (stim_tick_t)(uintptr_t)user_data;
+    }
+}
+
+/* Periods and deadlines that straddle the counter wrap at 0xFFFFFFFF */
+static void test_wrap(void) {
+    static stim_sched_t sched;
+    static const stim_tick_t periods[] = {300, 100, 700, 250, 50};
+    stim_t timers[5];
+    stim_t periodic;
+    int i;
+    stim_sched_init(&sched);
+    advance_to(&sched, (stim_tick_t)-0x100);
+    for (i = 0; i < 5; ++i) {
+        stim_sched_timer_init(&sched, &timers[i], periods[i],
+                              STIM_CB_MODE_IMMEDIATE, order_cb,
+                              (void *)(uintptr_t)periods[i]);
+        stim_set_mode(&timers[i], STIM_MODE_ONESHOT);
+        stim_start(&timers[i]);
+    }
+    stim_sched_timer_init(&sched, &periodic, 1000, STIM_CB_MODE_IMMEDIATE,
+                          NULL, NULL);
+    stim_start(&periodic);
+    order_num = 0;
+    stim_sched_poll(&sched);
+    for (i = 0; i < 10000; ++i) {
+        stim_sched_tick_inc(&sched);
+        stim_sched_poll(&sched);
+    }
+    /* Timers expiring on different ticks are called back in order */
+    CHECK(order_num == 5);
+    for (i = 1; i < order_num; ++i) {
+        CHECK(order_log[i - 1] < order_log[i]);
+    }
+    CHECK(get_count(&periodic) == 10);
+    CHECK(get_count(&timers[0]) == 1);
+    CHECK(timers[0].state == STIM_STATE_STOPPED);
+}
+
+static uint32_t deferred_calls;
+
+static void deferred_cb(stim_t *timer, void *user_data) {
+    (void)timer;
+    (void)user_data;
+    ++deferred_calls;
+}
+
+/* One dispatch call runs at most 255 events, repeat until none is left */
+static void dispatch_all(stim_sched_t *sched) {
+    uint32_t calls;
+    do {
+        calls = deferred_calls;
+        stim_sched_dispatch(sched, 255);
+    } while (deferred_calls != calls);
+}
+
+static void test_queue_full(void) {
+    static stim_sched_t sched;
+    static stim_t timers[STIM_QUEUE_CAPACITY + 1];
+    static stim_t *batch[STIM_QUEUE_CAPACITY + 1];
+    stim_t deferred;
+#if defined(STIM_STATS)
+    stim_stats_t stats;
+#endif
+    int i;
+    stim_sched_init(&sched);
+    for (i = 0; i < STIM_QUEUE_CAPACITY + 1; ++i) {
+        stim_sched_timer_init(&sched, &timers[i], 10, STIM_CB_MODE_IMMEDIATE,
+                              NULL, NULL);
+        batch[i] = &timers[i];
+    }
+    for (i = 0; i < STIM_QUEUE_CAPACITY; ++i) {
+        CHECK(!stim_start(&timers[i]));
+    }
+    CHECK(stim_start(&timers[STIM_QUEUE_CAPACITY]) == -STIM_EAGAIN);
+#if defined(STIM_STATS)
+    CHECK(!stim_sched_get_stats(&sched, &stats));
+    CHECK(stats.command_rejects == 1);
+#endif
+    /* Commands for timers that already hold an entry still collapse into it */
+    for (i = 0; i < 1000; ++i) {
+        CHECK(!stim_restart(&timers[0]));
+    }
+    stim_sched_poll(&sched);
+    for (i = 0; i < STIM_QUEUE_CAPACITY; ++i) {
+        CHECK(timers[i].state == STIM_STATE_RUNNING);
+    }
+    CHECK(timers[STIM_QUEUE_CAPACITY].state == STIM_STATE_STOPPED);
+    CHECK(!stim_start(&timers[STIM_QUEUE_CAPACITY]));
+    stim_sched_poll(&sched);
+    CHECK(timers[STIM_QUEUE_CAPACITY].state == STIM_STATE_RUNNING);
+    /* A batch that can never fit is refused instead of retried forever */
+    CHECK(stim_stop_many(batch, STIM_QUEUE_CAPACITY + 1) == -STIM_EINVAL);
+    CHECK(!stim_stop_many(batch, STIM_QUEUE_CAPACITY));
+    stim_sched_tick_advance(&sched, 10);
+    stim_sched_poll(&sched);
+    CHECK(timers[0].state == STIM_STATE_STOPPED);
+    /* Expirations that find the event queue full are reported by the poll */
+    stim_sched_timer_init(&sched, &deferred, 1, STIM_CB_MODE_DEFERRED,
+                          deferred_cb, NULL);
+    stim_start(&deferred);
+    stim_sched_poll(&sched);
+    for (i = 0; i < STIM_QUEUE_CAPACITY; ++i) {
+        stim_sched_tick_inc(&sched);
+        stim_sched_poll(&sched);
+    }
+    stim_sched_tick_inc(&sched);
+#if defined(STIM_COALESCE_EVENTS)
+    /* Coalesced expirations share the single queued event of the timer */
+    CHECK(!stim_sched_poll(&sched));
+    deferred_calls = 0;
+    dispatch_all(&sched);
+    CHECK(deferred_calls == 1);
+    CHECK(deferred.expirations == STIM_QUEUE_CAPACITY + 1);
+#else
+    CHECK(stim_sched_poll(&sched) == -STIM_EAGAIN);
+    deferred_calls = 0;
+    dispatch_all(&sched);
+    CHECK(deferred_calls == STIM_QUEUE_CAPACITY);
+#endif
+}
+
+/* Without a real stim_lock() only the lock-free queue is thread-safe */
+#if defined(STIM_LOCKFREE_QUEUE) || defined(STIM_LOCK_HEADER)
+typedef struct {
+    stim_sched_t *sched;
+    stim_t timers[STRESS_TIMERS];
+    uint32_t seed;
+} producer_t;
+
+static atomic_int stress_done;
+
+static void post_retry(int (*post)(stim_t *), stim_t *timer) {
+    while (post(timer) == -STIM_EAGAIN) {
+        sched_yield();
+    }
+}
+
+static void *stress_producer(void *arg) {
+    producer_t *producer = arg;
+    uint32_t state = producer->seed;
+    stim_t *timer;
+    int i;
+    for (i = 0; i < STRESS_ITERATIONS; ++i) {
+        state ^= state << 13;
+        state ^= state >> 17;
+        state ^= state << 5;
+        timer = &producer->timers[state % STRESS_TIMERS];
+        switch ((state >> 8) % 3) {
+        case 0:
+            post_retry(stim_start, timer);
+            break;
+        case 1:
+            post_retry(stim_stop, timer);
+            break;
+        default:
+            post_retry(stim_restart, timer);
+            break;
+        }
+    }
+    for (i = 0; i < STRESS_TIMERS; ++i) {
+        post_retry(stim_stop, &producer->timers[i]);
+    }
+    return NULL;
+}
+
+static void *stress_poller(void *arg) {
+    stim_sched_t *sched = arg;
+    while (!stress_done) {
+        stim_sched_tick_inc(sched);
+        stim_sched_poll(sched);
+    }
+    return NULL;
+}
+
+/*
+ * Producers hammer their own timers from several threads while one thread
+ * polls, every timer must end up in the state of its last command.
+ */
+static void test_stress(void) {
+    static stim_sched_t sched;
+    static producer_t producers[STRESS_PRODUCERS];
+    pthread_t threads[STRESS_PRODUCERS];
+    pthread_t poller;
+    int i;
+    int j;
+    stim_sched_init(&sched);
+    for (i = 0; i < STRESS_PRODUCERS; ++i) {
+        producers[i].sched = &sched;
+        producers[i].seed = 0x12345u + (uint32_t)i * 7919u;
+        for (j = 0; j < STRESS_TIMERS; ++j) {
+            stim_sched_timer_init(&sched, &producers[i].timers[j],
+                                  1 + (stim_tick_t)(i + j) % 50,
+                                  STIM_CB_MODE_IMMEDIATE, NULL, NULL);
+        }
+    }
+    stress_done = 0;
+    pthread_create(&poller, NULL, stress_poller, &sched);
+    for (i = 0; i < STRESS_PRODUCERS; ++i) {
+        pthread_create(&threads[i], NULL, stress_producer, &producers[i]);
+    }
+    for (i = 0; i < STRESS_PRODUCERS; ++i) {
+        pthread_join(threads[i], NULL);
+    }
+    stress_done = 1;
+    pthread_join(poller, NULL);
+    /* Let tombstones reach the head of the list as well */
+    stim_sched_tick_advance(&sched, 100);
+    stim_sched_poll(&sched);
+    stim_sched_poll(&sched);
+    for (i = 0; i < STRESS_PRODUCERS; ++i) {
+        for (j = 0; j < STRESS_TIMERS; ++j) {
+            CHECK(producers[i].timers[j].state == STIM_STATE_STOPPED);
+            CHECK(!stim_start(&producers[i].timers[j]));
+        }
+        stim_sched_poll(&sched);
+    }
+    for (i = 0; i < STRESS_PRODUCERS; ++i) {
+        for (j = 0; j < STRESS_TIMERS; ++j) {
+            CHECK(producers[i].timers[j].state == STIM_STATE_RUNNING);
+        }
+    }
+}
+
+static atomic_int dispatch_done;
+
+static void expirations_cb(stim_t *timer, void *user_data) {
+    uint32_t expirations = 0;
+    stim_get_expirations(timer, &expirations);
+    *(uint32_t *)user_data += expirations;
+    ++deferred_calls;
+}
+
+static void *stress_dispatcher(void *arg) {
+    stim_sched_t *sched = arg;
+    while (!dispatch_done) {
+        stim_sched_dispatch(sched, 255);
+    }
+    return NULL;
+}
+
+/*
+ * One thread polls deferred timers while another dispatches them, every
+ * timer must keep being called back once both are back on one thread.
+ */
+static void test_dispatch_stress(void) {
+    static stim_sched_t sched;
+    stim_t timers[STRESS_TIMERS];
+    uint32_t fired[STRESS_TIMERS];
+    pthread_t dispatcher;
+    int i;
+    int j;
+    stim_sched_init(&sched);
+    for (i = 0; i < STRESS_TIMERS; ++i) {
+        fired[i] = 0;
+        stim_sched_timer_init(&sched, &timers[i], 1, STIM_CB_MODE_DEFERRED,
+                              expirations_cb, &fired[i]);
+        stim_set_mode(&timers[i], STIM_MODE_PERIODIC);
+        CHECK(!stim_start(&timers[i]));
+    }
+    stim_sched_poll(&sched);
+    dispatch_done = 0;
+    pthread_create(&dispatcher, NULL, stress_dispatcher, &sched);
+    for (i = 0; i < DISPATCH_ITERATIONS; ++i) {
+        stim_sched_tick_inc(&sched);
+        stim_sched_poll(&sched);
+    }
+    dispatch_done = 1;
+    pthread_join(dispatcher, NULL);
+    dispatch_all(&sched);
+#if defined(STIM_COALESCE_EVENTS)
+    /* Folded expirations are never dropped with fewer timers than slots */
+    for (i = 0; i < STRESS_TIMERS; ++i) {
+        CHECK(fired[i] == DISPATCH_ITERATIONS);
+    }
+#endif
+    for (i = 0; i < STRESS_TIMERS; ++i) {
+        fired[i] = 0;
+    }
+    for (j = 0; j < 10; ++j) {
+        stim_sched_tick_inc(&sched);
+        stim_sched_poll(&sched);
+        stim_sched_dispatch(&sched, 255);
+    }
+    for (i = 0; i < STRESS_TIMERS; ++i) {
+        CHECK(fired[i] == 10);
+    }
+}
+
+#endif
+
+#if defined(STIM_DISPATCH_WAIT) && defined(STIM_POLL_WAIT)
+#include <fcntl.h>
+
+static int fd_open(int fd) {
+    return fcntl(fd, F_GETFD) >= 0;
+}
+
+/* Teardown closes every lazily created descriptor and allows reuse */
+static void test_deinit(void) {
+    static stim_sched_t sched;
+    int poll_fd;
+    int event_fd;
+    int round;
+    stim_sched_init(&sched);
+    for (round = 0; round < 2; ++round) {
+        poll_fd = stim_sched_poll_fd(&sched);
+        event_fd = stim_sched_dispatch_fd(&sched);
+        CHECK(poll_fd >= 0 && fd_open(poll_fd));
+        CHECK(event_fd >= 0 && fd_open(event_fd));
+        CHECK(!stim_sched_poll_wait(&sched, 0));
+        CHECK(!stim_sched_deinit(&sched));
+        CHECK(!fd_open(poll_fd));
+        CHECK(!fd_open(event_fd));
+    }
+    CHECK(stim_sched_deinit(NULL) == -STIM_EINVAL);
+}
+
+#if defined(STIM_LOCKFREE_QUEUE) || defined(STIM_LOCK_HEADER)
+#define FD_THREADS 4
+#define FD_ROUNDS 200
+
+typedef struct {
+    stim_sched_t *sched;
+    int poll_fd;
+    int event_fd;
+} fd_user_t;
+
+static atomic_int fd_go;
+
+static int fd_count(void) {
+    int fd;
+    int count = 0;
+    for (fd = 0; fd < 1024; ++fd) {
+        count += fd_open(fd);
+    }
+    return count;
+}
+
+static void *fd_user(void *arg) {
+    fd_user_t *user = arg;
+    while (!fd_go) {
+        sched_yield();
+    }
+    user->poll_fd = stim_sched_poll_fd(user->sched);
+    user->event_fd = stim_sched_dispatch_fd(user->sched);
+    return NULL;
+}
+
+/* Concurrent first users must agree on one set of descriptors */
+static void test_fd_race(void) {
+    static stim_sched_t sched;
+    fd_user_t users[FD_THREADS];
+    pthread_t threads[FD_THREADS];
+    int baseline = fd_count();
+    int round;
+    int i;
+    for (round = 0; round < FD_ROUNDS; ++round) {
+        stim_sched_init(&sched);
+        fd_go = 0;
+        for (i = 0; i < FD_THREADS; ++i) {
+            users[i].sched = &sched;
+            pthread_create(&threads[i], NULL, fd_user, &users[i]);
+        }
+        fd_go = 1;
+        for (i = 0; i < FD_THREADS; ++i) {
+            pthread_join(threads[i], NULL);
+            CHECK(users[i].poll_fd >= 0 &&
+                  users[i].poll_fd == users[0].poll_fd);
+            CHECK(users[i].event_fd >= 0 &&
+                  users[i].event_fd == users[0].event_fd);
+        }
+        CHECK(!stim_sched_deinit(&sched));
+        CHECK(fd_count() == baseline);
+    }
+}
+#endif
+#endif
+
+int main(void) {
+    test_wheel_cascade();
+    test_idle_jump();
+    test_stop_reuse();
+    test_wrap();
+    test_queue_full();
+    test_fuzz();
+#if defined(STIM_DISPATCH_WAIT) && defined(STIM_POLL_WAIT)
+    test_deinit();
+#if defined(STIM_LOCKFREE_QUEUE) || defined(STIM_LOCK_HEADER)
+    test_fd_race();
+#endif
+#endif
+#if defined(STIM_LOCKFREE_QUEUE) || defined(STIM_LOCK_HEADER)
+    test_stress();
+    test_dispatch_stress();
+#endif
+    printf("%s\n", failures ? "FAIL" : "OK");
+    return failures ? 1 : 0;
+}